@@ -1,5 +1,16 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define MPC_MMAP
+#endif
+
 /*
 ** State Type
 */
@@ -122,9 +133,7 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt, ...)
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
   
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
@@ -155,6 +164,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0; 
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char unescaped[4];
   
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -179,7 +189,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -293,18 +303,26 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and 
 ** only support a single character lookahead at 
-** any point, when the input is marked for a 
-** potential backtracking we start buffering any 
-** input.
+** any point, all input is read into a buffer a
+** line or a chunk at a time. The buffer only
+** keeps what is after the oldest mark, or after
+** the current position when nothing is marked,
+** and drops the rest when it next fills up.
 **
 ** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** back we can simply move the position back
+** within the buffer.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** Where the system allows it regular files given
+** to `mpc_parse_contents` are not read as a File
+** at all but mapped into memory and parsed as a
+** String. The mapping is not terminated so
+** String input never reads past its length.
+**
 */
 
 enum {
@@ -313,6 +331,12 @@ enum {
   MPC_INPUT_PIPE   = 2
 };
 
+enum {
+  MPC_STORAGE_OWNED    = 0,
+  MPC_STORAGE_MAPPED   = 1,
+  MPC_STORAGE_BORROWED = 2
+};
+
 typedef struct {
 
   int type;
@@ -323,8 +347,15 @@ typedef struct {
   char *buffer;
   FILE *file;
   
+  long length;
+  long buffer_start;
+  long buffer_length;
+  long buffer_alloc;
+  int storage;
+  
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   char* lasts;
   
@@ -332,7 +363,14 @@ typedef struct {
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/*
+** String input borrows the caller's buffer rather
+** than copying it. Every caller keeps the string
+** alive until the input is deleted, and it is
+** only ever read up to `length`.
+*/
+
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string, long length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -342,13 +380,18 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->length = length;
+  i->string = (char*)string;
+  i->storage = MPC_STORAGE_BORROWED;
   i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_alloc = 0;
   i->file = NULL;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
 
@@ -370,9 +413,15 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = pipe;
+  i->length = 0;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_alloc = 0;
+  i->storage = MPC_STORAGE_OWNED;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -394,9 +443,15 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = file;
+  i->length = 0;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_alloc = 0;
+  i->storage = MPC_STORAGE_OWNED;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -405,11 +460,48 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   return i;
 }
 
+#ifdef MPC_MMAP
+
+/*
+** Map a regular file read only as a String input.
+** Returns NULL for anything that cannot be mapped,
+** such as pipes, devices or empty files, and the
+** caller falls back to reading it as a File.
+*/
+
+static mpc_input_t *mpc_input_new_mapped(const char *filename, FILE *file) {
+  
+  mpc_input_t *i;
+  struct stat st;
+  void *map;
+  
+  if (fstat(fileno(file), &st) != 0) { return NULL; }
+  if (!S_ISREG(st.st_mode) || st.st_size <= 0) { return NULL; }
+  
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (map == MAP_FAILED) { return NULL; }
+  posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+  
+  i = mpc_input_new_file(filename, NULL);
+  i->type = MPC_INPUT_STRING;
+  i->string = map;
+  i->length = st.st_size;
+  i->storage = MPC_STORAGE_MAPPED;
+  return i;
+}
+
+#endif
+
 static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  if (i->type == MPC_INPUT_STRING) {
+#ifdef MPC_MMAP
+    if (i->storage == MPC_STORAGE_MAPPED) { munmap(i->string, i->length); }
+#endif
+    if (i->storage == MPC_STORAGE_OWNED) { free(i->string); }
+  }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
   free(i->marks);
@@ -420,20 +512,30 @@ static void mpc_input_delete(mpc_input_t *i) {
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
+/*
+** Marks are a stack which doubles when it fills
+** and is never shrunk, so marking and unmarking
+** only allocate while the nesting reaches a new
+** depth for this input.
+*/
+
+enum { MPC_INPUT_MARKS_MIN = 32 };
+
 static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-  i->marks[i->marks_num-1] = i->state;
-  i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  if (i->marks_num > i->marks_slots) {
+    i->marks_slots = i->marks_slots ? i->marks_slots * 2 : MPC_INPUT_MARKS_MIN;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
   
+  i->marks[i->marks_num-1] = i->state;
+  i->lasts[i->marks_num-1] = i->last;
+  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -441,13 +543,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-  
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
-  }
   
 }
 
@@ -465,18 +560,62 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
+/*
+** Read more of a Pipe once the current position
+** has run off the end of the buffer. Returns 0 at
+** the end of input.
+**
+** When the buffer is full the bytes before the
+** oldest mark are dropped, and it is only grown
+** when that would free less than it keeps, so
+** every byte is moved a bounded number of times.
+**
+** Reads stop at a newline so an interactive pipe
+** is never left waiting on a whole chunk.
+*/
+
+enum { MPC_INPUT_CHUNK = 4096 };
+
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_start + i->buffer_length;
 }
 
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+  
+  long keep, drop;
+  int c;
+  
+  if (feof(i->file)) { return 0; }
+  
+  if (i->buffer_length == i->buffer_alloc) {
+    
+    keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+    drop = keep - i->buffer_start;
+    
+    if (i->buffer_alloc == 0 || drop < i->buffer_length - drop) {
+      i->buffer_alloc = i->buffer_alloc ? i->buffer_alloc * 2 : MPC_INPUT_CHUNK;
+      i->buffer = realloc(i->buffer, i->buffer_alloc);
+    }
+    
+    memmove(i->buffer, i->buffer + drop, i->buffer_length - drop);
+    i->buffer_start = keep;
+    i->buffer_length -= drop;
+  }
+  
+  while (i->buffer_length < i->buffer_alloc) {
+    c = getc(i->file);
+    if (c == EOF) { break; }
+    i->buffer[i->buffer_length++] = c;
+    if (c == '\n') { break; }
+  }
+  
+  return mpc_input_buffer_in_range(i);
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffer_in_range(i) && !mpc_input_buffer_fill(i)) { return 1; }
   return 0;
 }
 
@@ -486,20 +625,10 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
-    
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
-    
+      return mpc_input_buffer_in_range(i) || mpc_input_buffer_fill(i) ? i->buffer[i->state.pos - i->buffer_start] : '\0';
     default: return c;
   }
 }
@@ -509,7 +638,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -519,23 +648,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       return c;
     
     case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-    
+      return mpc_input_buffer_in_range(i) || mpc_input_buffer_fill(i) ? i->buffer[i->state.pos - i->buffer_start] : '\0';
     default: return c;
   }
   
@@ -546,16 +659,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
-    }
+    case MPC_INPUT_PIPE: { break; }
     default: { break; }
   }
   return 0;
@@ -563,15 +667,6 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
-      !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-  
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -628,14 +723,11 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
-  char *co = NULL;
   const char *x = c;
 
   mpc_input_mark(i);
   while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
+    if (!mpc_input_char(i, *x, NULL)) {
       mpc_input_rewind(i);
       return 0;
     }
@@ -643,11 +735,21 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (o) {
+    *o = malloc(strlen(c) + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
+static char *mpc_input_span(mpc_input_t *i, long pos) {
+  long n = i->state.pos - pos;
+  char *x = malloc(n + 1);
+  memcpy(x, i->string + pos, n);
+  x[n] = '\0';
+  return x;
+}
+
 static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char)) {
   return f(i->last, mpc_input_peekc(i));
 }
@@ -723,15 +825,37 @@ typedef union {
 
 struct mpc_parser_t {
   char retained;
+  char span;
   char *name;
+  int id;
   char type;
   mpc_pdata_t data;
 };
 
+enum {
+  MPC_SPAN_NONE  = 0,
+  MPC_SPAN_TEXT  = 1,
+  MPC_SPAN_EMPTY = 2
+};
+
 /*
 ** Stack Type
+**
+** Both stacks double when they fill and are
+** never shrunk during a parse. A stack can be
+** kept in a context between parses, found
+** through a thread local like the arena, in
+** which case it is reset rather than freed.
 */
 
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define MPC_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define MPC_THREAD_LOCAL __thread
+#else
+#define MPC_THREAD_LOCAL
+#endif
+
 typedef struct {
 
   int parsers_num;
@@ -748,9 +872,16 @@ typedef struct {
   
 } mpc_stack_t;
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
-  
+struct mpc_context_t {
+  mpc_stack_t stack;
+  int busy;
+};
+
+static MPC_THREAD_LOCAL mpc_context_t *mpc_context_current = NULL;
+
+enum { MPC_STACK_MIN = 32 };
+
+static void mpc_stack_init(mpc_stack_t *s) {
   s->parsers_num = 0;
   s->parsers_slots = 0;
   s->parsers = NULL;
@@ -761,11 +892,29 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   s->results = NULL;
   s->returns = NULL;
   
+  s->err = NULL;
+}
+
+static void mpc_stack_reset(mpc_stack_t *s, const char *filename) {
+  s->parsers_num = 0;
+  s->results_num = 0;
   s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
-  
+}
+
+static mpc_stack_t *mpc_stack_new(const char *filename) {
+  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+  mpc_stack_init(s);
+  mpc_stack_reset(s, filename);
   return s;
 }
 
+static void mpc_stack_free(mpc_stack_t *s) {
+  free(s->parsers);
+  free(s->states);
+  free(s->results);
+  free(s->returns);
+}
+
 static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
   mpc_err_t *errs[2];
   errs[0] = s->err;
@@ -784,12 +933,7 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
     r->error = s->err;
   }
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
-  
+  s->err = NULL;
   return success;
 }
 
@@ -801,15 +945,7 @@ static void mpc_stack_set_state(mpc_stack_t *s, int x) {
 
 static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
   if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
-}
-
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
+    s->parsers_slots = s->parsers_slots ? s->parsers_slots * 2 : MPC_STACK_MIN;
     s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
     s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
   }
@@ -826,7 +962,6 @@ static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
   s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
 }
 
 static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
@@ -854,15 +989,7 @@ static mpc_result_t mpc_result_out(mpc_val_t *x) {
 
 static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
   if (s->results_num > s->results_slots) {
-    s->results_slots = ceil((s->results_slots + 1) * 1.5);
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
-}
-
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
+    s->results_slots = s->results_slots ? s->results_slots * 2 : MPC_STACK_MIN;
     s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
     s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
   }
@@ -880,7 +1007,6 @@ static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
   *x = s->results[s->results_num-1];
   r = s->returns[s->results_num-1];
   s->results_num--;
-  mpc_stack_results_reserve_less(s);
   return r;
 }
 
@@ -902,7 +1028,7 @@ static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
   mpc_result_t x;
   while (n) {
     mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
+    if (ds) { ds[n-1](x.output); }
     n--;
   }
 }
@@ -911,7 +1037,7 @@ static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
   mpc_result_t x;
   while (n) {
     mpc_stack_popr(s, &x);
-    dx(x.output);
+    if (dx) { dx(x.output); }
     n--;
   }
 }
@@ -925,7 +1051,7 @@ static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
 }
 
 static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+  mpc_val_t *x = f ? f(n, (mpc_val_t**)(&s->results[s->results_num-n])) : NULL;
   mpc_stack_popr_n(s, n);
   return x;
 }
@@ -955,11 +1081,19 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 ** not smashing the stack).
 **
 ** But it is now a pretty ugly beast...
+**
+** When parsing a string and a parser that spans
+** its input is reached (see `mpc_span_check`)
+** `span` records how deep in the stack it sits.
+** Everything above it then produces no output,
+** runs no folds and no destructors, and when it
+** succeeds its result is the matched text copied
+** out of the input in one go.
 */
 
 #define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
-#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
+#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); v = (x); if (span > stk->parsers_num) { span = 0; v = mpc_input_span(i, span_pos); } mpc_stack_pushr(stk, mpc_result_out(v), 1); continue
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); if (span > stk->parsers_num) { span = 0; } mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
 #define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
@@ -967,12 +1101,28 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
   /* Stack */
   int st = 0;
   mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_context_t *ctx = mpc_context_current;
+  mpc_stack_t *stk;
   
   /* Variables */
-  char *s;
+  char *s = NULL;
+  char **o;
+  mpc_val_t *v;
   mpc_result_t r;
+  int span = 0;
+  long span_pos = 0;
+  int res;
 
+  /* A context already in use by an outer parse is left alone */
+  if (ctx && !ctx->busy) {
+    ctx->busy = 1;
+    stk = &ctx->stack;
+    mpc_stack_reset(stk, i->filename);
+  } else {
+    ctx = NULL;
+    stk = mpc_stack_new(i->filename);
+  }
+  
   /* Go! */
   mpc_stack_pushp(stk, init);
   
@@ -980,24 +1130,33 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
     
     mpc_stack_peepp(stk, &p, &st);
     
+    /* `predict` pops itself without a result of its own so its child starts the span */
+    if (!span && st == 0 && p->span == MPC_SPAN_TEXT && p->type != MPC_TYPE_PREDICT && i->type == MPC_INPUT_STRING) {
+      span = stk->parsers_num;
+      span_pos = i->state.pos;
+    }
+    
+    s = NULL;
+    o = span ? NULL : &s;
+    
     switch (p->type) {
       
       /* Basic Parsers */
 
-      case MPC_TYPE_ANY:       MPC_PRIMITIVE(s, mpc_input_any(i, &s));
-      case MPC_TYPE_SINGLE:    MPC_PRIMITIVE(s, mpc_input_char(i, p->data.single.x, &s));
-      case MPC_TYPE_RANGE:     MPC_PRIMITIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-      case MPC_TYPE_ONEOF:     MPC_PRIMITIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-      case MPC_TYPE_NONEOF:    MPC_PRIMITIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
-      case MPC_TYPE_SATISFY:   MPC_PRIMITIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
-      case MPC_TYPE_STRING:    MPC_PRIMITIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      case MPC_TYPE_ANY:       MPC_PRIMITIVE(s, mpc_input_any(i, o));
+      case MPC_TYPE_SINGLE:    MPC_PRIMITIVE(s, mpc_input_char(i, p->data.single.x, o));
+      case MPC_TYPE_RANGE:     MPC_PRIMITIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, o));
+      case MPC_TYPE_ONEOF:     MPC_PRIMITIVE(s, mpc_input_oneof(i, p->data.string.x, o));
+      case MPC_TYPE_NONEOF:    MPC_PRIMITIVE(s, mpc_input_noneof(i, p->data.string.x, o));
+      case MPC_TYPE_SATISFY:   MPC_PRIMITIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, o));
+      case MPC_TYPE_STRING:    MPC_PRIMITIVE(s, mpc_input_string(i, p->data.string.x, o));
       
       /* Other parsers */
       
       case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
       case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
       case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(span ? NULL : p->data.lift.lf());
       case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
       case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
       
@@ -1058,12 +1217,12 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
             mpc_input_rewind(i);
-            p->data.not.dx(r.output);
+            if (!span) { p->data.not.dx(r.output); }
             MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
           } else {
             mpc_input_unmark(i);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(span ? NULL : p->data.not.lf());
           }
         }
       
@@ -1074,7 +1233,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(span ? NULL : p->data.not.lf());
           }
         }
       
@@ -1088,7 +1247,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             mpc_stack_popr(stk, &r);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+            MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, span ? NULL : p->data.repeat.f));
           }
         }
       
@@ -1104,7 +1263,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, span ? NULL : p->data.repeat.f));
             }
           }
         }
@@ -1117,14 +1276,14 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             if (st != (p->data.repeat.n+1)) {
               mpc_stack_popr(stk, &r);
-              mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
+              mpc_stack_popr_out_single(stk, st-1, span ? NULL : p->data.repeat.dx);
               mpc_input_rewind(i);
               MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
               mpc_input_unmark(i);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, span ? NULL : p->data.repeat.f));
             }
           }
         }
@@ -1148,18 +1307,18 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       case MPC_TYPE_AND:
         
-        if (p->data.and.n == 0) { MPC_SUCCESS(p->data.and.f(0, NULL)); }
+        if (p->data.and.n == 0) { MPC_SUCCESS(span ? NULL : p->data.and.f(0, NULL)); }
         
         if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.and.xs[st]); }
         if (st <= p->data.and.n) {
           if (!mpc_stack_peekr(stk, &r)) {
             mpc_input_rewind(i);
             mpc_stack_popr(stk, &r);
-            mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
+            mpc_stack_popr_out(stk, st-1, span ? NULL : p->data.and.dxs);
             MPC_FAILURE(r.error);
           }
           if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
-          if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
+          if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, span ? NULL : p->data.and.f)); }
         }
       
       /* End */
@@ -1170,7 +1329,16 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
     }
   }
   
-  return mpc_stack_terminate(stk, final);
+  res = mpc_stack_terminate(stk, final);
+  
+  if (ctx) {
+    ctx->busy = 0;
+  } else {
+    mpc_stack_free(stk);
+    free(stk);
+  }
+  
+  return res;
   
 }
 
@@ -1181,7 +1349,15 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_input_t *i = mpc_input_new_string(filename, string, strlen(string));
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_nstring(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1207,6 +1383,9 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
   int res;
+#ifdef MPC_MMAP
+  mpc_input_t *i;
+#endif
   
   if (f == NULL) {
     r->output = NULL;
@@ -1214,6 +1393,16 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
   
+#ifdef MPC_MMAP
+  i = mpc_input_new_mapped(filename, f);
+  if (i != NULL) {
+    res = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    fclose(f);
+    return res;
+  }
+#endif
+  
   res = mpc_parse_file(filename, f, p, r);
   fclose(f);
   return res;
@@ -1317,6 +1506,7 @@ static mpc_parser_t *mpc_undefined(void) {
   p->retained = 0;
   p->type = MPC_TYPE_UNDEFINED;
   p->name = NULL;
+  p->id = 0;
   return p;
 }
 
@@ -1334,6 +1524,20 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
   return p;
 }
 
+/*
+** Rule IDs are given out by `mpca_lang` and
+** `mpca_grammar` as the position of the parser
+** in their argument list, counting from one.
+** Every AST node built by a rule carries the
+** ID of the innermost rule that produced it so
+** nodes can be classified by comparing integers
+** rather than searching the tag string.
+*/
+
+int mpc_id(mpc_parser_t *p) {
+  return p->id;
+}
+
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
   if (p->retained) {
@@ -1364,10 +1568,107 @@ void mpc_cleanup(int n, ...) {
   free(list);
 }
 
+/*
+** A parser spans its input when its output is
+** exactly the text it consumed as a new string,
+** or when it consumes nothing and outputs NULL.
+** Primitives span, and so do the `mpcf_strfold`
+** repetitions and sequences of them that regular
+** expressions compile into, so when a string is
+** parsed the text can be copied out once at the
+** end instead of building it a character at a
+** time. This is worked out as each parser is
+** built from its children. Retained parsers can
+** be redefined later so they never span.
+*/
+
+static int mpc_span_of(mpc_parser_t *p) {
+  return p->retained ? MPC_SPAN_NONE : p->span;
+}
+
+static mpc_parser_t *mpc_span_check(mpc_parser_t *p) {
+  
+  int i, x, s = MPC_SPAN_NONE;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_ANCHOR:
+      s = MPC_SPAN_EMPTY;
+      break;
+    
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf == mpcf_ctor_null) { s = MPC_SPAN_EMPTY; }
+      if (p->data.lift.lf == mpcf_ctor_str)  { s = MPC_SPAN_TEXT; }
+      break;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+      s = MPC_SPAN_TEXT;
+      break;
+    
+    case MPC_TYPE_EXPECT:  s = mpc_span_of(p->data.expect.x);  break;
+    case MPC_TYPE_PREDICT: s = mpc_span_of(p->data.predict.x); break;
+    
+    /* On success `not` has consumed nothing so only its lifted value matters */
+    case MPC_TYPE_NOT:
+      if (mpc_span_of(p->data.not.x) == MPC_SPAN_NONE) { break; }
+      if (p->data.not.lf == mpcf_ctor_str)  { s = MPC_SPAN_TEXT; }
+      if (p->data.not.lf == mpcf_ctor_null) { s = MPC_SPAN_EMPTY; }
+      break;
+    
+    case MPC_TYPE_MAYBE:
+      x = mpc_span_of(p->data.not.x);
+      if (x == MPC_SPAN_TEXT  && p->data.not.lf == mpcf_ctor_str)  { s = MPC_SPAN_TEXT; }
+      if (x == MPC_SPAN_EMPTY && p->data.not.lf == mpcf_ctor_null) { s = MPC_SPAN_EMPTY; }
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f == mpcf_strfold
+      &&  mpc_span_of(p->data.repeat.x) == MPC_SPAN_TEXT) { s = MPC_SPAN_TEXT; }
+      break;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { break; }
+      s = mpc_span_of(p->data.or.xs[0]);
+      for (i = 1; i < p->data.or.n; i++) {
+        if (mpc_span_of(p->data.or.xs[i]) != s) { s = MPC_SPAN_NONE; }
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f == mpcf_strfold) {
+        s = MPC_SPAN_TEXT;
+        for (i = 0; i < p->data.and.n; i++) {
+          if (mpc_span_of(p->data.and.xs[i]) != MPC_SPAN_TEXT) { s = MPC_SPAN_NONE; }
+        }
+      }
+      if (p->data.and.n == 2 && p->data.and.f == mpcf_snd
+      &&  mpc_span_of(p->data.and.xs[0]) == MPC_SPAN_EMPTY
+      &&  mpc_span_of(p->data.and.xs[1]) == MPC_SPAN_TEXT) { s = MPC_SPAN_TEXT; }
+      if (p->data.and.n == 2 && p->data.and.f == mpcf_fst
+      &&  mpc_span_of(p->data.and.xs[0]) == MPC_SPAN_TEXT
+      &&  mpc_span_of(p->data.and.xs[1]) == MPC_SPAN_EMPTY) { s = MPC_SPAN_TEXT; }
+      break;
+    
+    default: break;
+  }
+  
+  p->span = s;
+  return p;
+}
+
 mpc_parser_t *mpc_pass(void) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_PASS;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_fail(const char *m) {
@@ -1428,14 +1729,14 @@ mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_LIFT;
   p->data.lift.lf = lf;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ANCHOR;
   p->data.anchor.f = f;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_state(void) {
@@ -1450,7 +1751,7 @@ mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
   p->data.expect.x = a;
   p->data.expect.m = malloc(strlen(expected) + 1);
   strcpy(p->data.expect.m, expected);
-  return p;
+  return mpc_span_check(p);
 }
 
 /*
@@ -1488,7 +1789,7 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
   buffer = realloc(buffer, strlen(buffer) + 1);
   p->data.expect.x = a;
   p->data.expect.m = buffer;
-  return p;
+  return mpc_span_check(p);
 }
 
 /*
@@ -1498,14 +1799,14 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
 mpc_parser_t *mpc_any(void) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ANY;
-  return mpc_expect(p, "any character");
+  return mpc_expect(mpc_span_check(p), "any character");
 }
 
 mpc_parser_t *mpc_char(char c) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SINGLE;
   p->data.single.x = c;
-  return mpc_expectf(p, "'%c'", c);
+  return mpc_expectf(mpc_span_check(p), "'%c'", c);
 }
 
 mpc_parser_t *mpc_range(char s, char e) {
@@ -1513,7 +1814,7 @@ mpc_parser_t *mpc_range(char s, char e) {
   p->type = MPC_TYPE_RANGE;
   p->data.range.x = s;
   p->data.range.y = e;
-  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+  return mpc_expectf(mpc_span_check(p), "character between '%c' and '%c'", s, e);
 }
 
 mpc_parser_t *mpc_oneof(const char *s) {
@@ -1521,7 +1822,7 @@ mpc_parser_t *mpc_oneof(const char *s) {
   p->type = MPC_TYPE_ONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+  return mpc_expectf(mpc_span_check(p), "one of '%s'", s);
 }
 
 mpc_parser_t *mpc_noneof(const char *s) {
@@ -1529,7 +1830,7 @@ mpc_parser_t *mpc_noneof(const char *s) {
   p->type = MPC_TYPE_NONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+  return mpc_expectf(mpc_span_check(p), "one of '%s'", s);
 
 }
 
@@ -1537,7 +1838,7 @@ mpc_parser_t *mpc_satisfy(int(*f)(char)) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SATISFY;
   p->data.satisfy.f = f;
-  return mpc_expectf(p, "character satisfying function %p", f);
+  return mpc_expectf(mpc_span_check(p), "character satisfying function %p", f);
 }
 
 mpc_parser_t *mpc_string(const char *s) {
@@ -1545,7 +1846,7 @@ mpc_parser_t *mpc_string(const char *s) {
   p->type = MPC_TYPE_STRING;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "\"%s\"", s);
+  return mpc_expectf(mpc_span_check(p), "\"%s\"", s);
 }
 
 /*
@@ -1573,7 +1874,7 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_PREDICT;
   p->data.predict.x = a;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
@@ -1582,7 +1883,7 @@ mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   p->data.not.x = a;
   p->data.not.dx = da;
   p->data.not.lf = lf;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
@@ -1594,7 +1895,7 @@ mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
   p->type = MPC_TYPE_MAYBE;
   p->data.not.x = a;
   p->data.not.lf = lf;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
@@ -1606,7 +1907,7 @@ mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
@@ -1614,7 +1915,7 @@ mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY1;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
@@ -1624,7 +1925,7 @@ mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
   p->data.repeat.f = f;
   p->data.repeat.x = a;
   p->data.repeat.dx = da;
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_or(int n, ...) {
@@ -1644,7 +1945,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   }
   va_end(va);
   
-  return p;
+  return mpc_span_check(p);
 }
 
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
@@ -1669,7 +1970,7 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
   }  
   va_end(va);
   
-  return p;
+  return mpc_span_check(p);
 }
 
 /*
@@ -2498,6 +2799,129 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 }
 
 
+/*
+** Arena
+**
+** An arena is a chain of blocks that AST
+** nodes are carved out of by bumping a
+** pointer. Blocks double in size so a parse
+** only touches malloc a handful of times and
+** everything is released at once by clearing
+** the arena, which keeps the newest block for
+** the next parse.
+**
+** The AST functions have no room for an extra
+** argument so the arena in use is found
+** through a thread local set for the duration
+** of `mpc_parse_arena`. While it is set
+** deleting nodes does nothing.
+*/
+
+enum {
+  MPC_ARENA_ALIGN = 16,
+  MPC_ARENA_BLOCK = 65536
+};
+
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  size_t size;
+  size_t used;
+} mpc_arena_block_t;
+
+struct mpc_arena_t {
+  mpc_arena_block_t *blocks;
+};
+
+static MPC_THREAD_LOCAL mpc_arena_t *mpc_arena_current = NULL;
+
+#define MPC_ARENA_HEADER ((sizeof(mpc_arena_block_t) + MPC_ARENA_ALIGN - 1) & ~(size_t)(MPC_ARENA_ALIGN - 1))
+
+mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *a = malloc(sizeof(mpc_arena_t));
+  a->blocks = NULL;
+  return a;
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+  
+  mpc_arena_block_t *b = a->blocks;
+  size_t size;
+  void *x;
+  
+  n = (n + MPC_ARENA_ALIGN - 1) & ~(size_t)(MPC_ARENA_ALIGN - 1);
+  
+  if (b == NULL || b->used + n > b->size) {
+    size = b ? b->size * 2 : MPC_ARENA_BLOCK;
+    while (size < n) { size *= 2; }
+    b = malloc(MPC_ARENA_HEADER + size);
+    b->next = a->blocks;
+    b->size = size;
+    b->used = 0;
+    a->blocks = b;
+  }
+  
+  x = (char*)b + MPC_ARENA_HEADER + b->used;
+  b->used += n;
+  return x;
+}
+
+void mpc_arena_clear(mpc_arena_t *a) {
+  
+  mpc_arena_block_t *b;
+  
+  if (a->blocks == NULL) { return; }
+  
+  b = a->blocks->next;
+  while (b) {
+    mpc_arena_block_t *n = b->next;
+    free(b);
+    b = n;
+  }
+  
+  a->blocks->next = NULL;
+  a->blocks->used = 0;
+}
+
+void mpc_arena_delete(mpc_arena_t *a) {
+  mpc_arena_clear(a);
+  free(a->blocks);
+  free(a);
+}
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_arena_t *a) {
+  int x;
+  mpc_arena_t *prev = mpc_arena_current;
+  mpc_arena_current = a;
+  x = mpc_parse(filename, string, p, r);
+  mpc_arena_current = prev;
+  return x;
+}
+
+/*
+** Context
+*/
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  mpc_stack_init(&c->stack);
+  c->busy = 0;
+  return c;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  mpc_stack_free(&c->stack);
+  free(c);
+}
+
+int mpc_parse_context(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_context_t *c) {
+  int x;
+  mpc_context_t *prev = mpc_context_current;
+  mpc_context_current = c;
+  x = mpc_parse(filename, string, p, r);
+  mpc_context_current = prev;
+  return x;
+}
+
 /*
 ** AST
 */
@@ -2507,6 +2931,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
   
   if (a == NULL) { return; }
+  if (mpc_arena_current) { return; }
   
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2520,6 +2945,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (mpc_arena_current) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
@@ -2528,14 +2954,29 @@ static void mpc_ast_delete_no_children(mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
-  
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
-  
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  mpc_ast_t *a;
+  size_t tl, cl;
+  
+  /* In an arena the node, tag and contents share a single allocation */
+  if (mpc_arena_current) {
+    tl = strlen(tag) + 1;
+    cl = strlen(contents) + 1;
+    a = mpc_arena_alloc(mpc_arena_current, sizeof(mpc_ast_t) + tl + cl);
+    a->tag = (char*)(a + 1);
+    a->contents = a->tag + tl;
+    memcpy(a->tag, tag, tl);
+    memcpy(a->contents, contents, cl);
+  } else {
+    a = malloc(sizeof(mpc_ast_t));
+    
+    a->tag = malloc(strlen(tag) + 1);
+    strcpy(a->tag, tag);
+    
+    a->contents = malloc(strlen(contents) + 1);
+    strcpy(a->contents, contents);
+  }
   
+  a->id = 0;
   a->state = mpc_state_new();
   
   a->children_num = 0;
@@ -2579,6 +3020,8 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
 
+  /* Only parsed nodes carry a rule ID, so compare them when both do */
+  if (a->id && b->id && a->id != b->id) { return 0; }
   if (strcmp(a->tag, b->tag) != 0) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
@@ -2591,6 +3034,21 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  
+  int n = r->children_num;
+  mpc_ast_t **cs;
+  
+  /* Arena child arrays have room for the next power of two (at least four) */
+  if (mpc_arena_current) {
+    if (n == 0 || (n >= 4 && (n & (n - 1)) == 0)) {
+      cs = mpc_arena_alloc(mpc_arena_current, sizeof(mpc_ast_t*) * (n ? n * 2 : 4));
+      if (n) { memcpy(cs, r->children, sizeof(mpc_ast_t*) * n); }
+      r->children = cs;
+    }
+    r->children[r->children_num++] = a;
+    return r;
+  }
+  
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
@@ -2598,7 +3056,23 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  
+  char *tag;
+  size_t tl, al;
+  
   if (a == NULL) { return a; }
+  
+  if (mpc_arena_current) {
+    tl = strlen(t);
+    al = strlen(a->tag) + 1;
+    tag = mpc_arena_alloc(mpc_arena_current, tl + 1 + al);
+    memcpy(tag, t, tl);
+    tag[tl] = '|';
+    memcpy(tag + tl + 1, a->tag, al);
+    a->tag = tag;
+    return a;
+  }
+  
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2606,7 +3080,18 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   return a;
 }
 
+mpc_ast_t *mpc_ast_add_id(mpc_ast_t *a, int id) {
+  if (a == NULL) { return a; }
+  if (a->id == 0) { a->id = id; }
+  return a;
+}
+
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (mpc_arena_current) {
+    a->tag = mpc_arena_alloc(mpc_arena_current, strlen(t) + 1);
+    strcpy(a->tag, t);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2902,6 +3387,9 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       if (st->parsers[st->parsers_num-1] == NULL) {
         return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
       }
+      if (st->parsers[st->parsers_num-1]->id == 0) {
+        st->parsers[st->parsers_num-1]->id = st->parsers_num;
+      }
     }
     
     return st->parsers[st->parsers_num-1];
@@ -2926,6 +3414,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       st->parsers[st->parsers_num-1] = p;
       
       if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (p->id == 0) { p->id = st->parsers_num; }
       if (p->name && strcmp(p->name, x) == 0) { return p; }
       
     }
@@ -2934,16 +3423,26 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
   
 }
 
+static mpc_val_t *mpcaf_ast_rule_id(mpc_val_t *x, void *p) {
+  return mpc_ast_add_id(x, ((mpc_parser_t*)p)->id);
+}
+
+static mpc_val_t *mpcaf_ast_rule_tag(mpc_val_t *x, void *p) {
+  mpc_parser_t *q = p;
+  return mpc_ast_add_tag(mpc_ast_add_id(x, q->id), q->name);
+}
+
 static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   
   mpca_grammar_st_t *st = s;
   mpc_parser_t *p = mpca_grammar_find_parser(x, st);
   free(x);
 
-  if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+  /* With rule IDs only the node just gets an integer, no string is rebuilt */
+  if (p->name && !(st->flags & MPCA_LANG_RULE_IDS)) {
+    return mpca_state(mpca_root(mpc_apply_to(p, mpcaf_ast_rule_tag, p)));
   } else {
-    return mpca_state(mpca_root(p));
+    return mpca_state(mpca_root(mpc_apply_to(p, mpcaf_ast_rule_id, p)));
   }
 }
 
@@ -3214,7 +3713,7 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_string("<mpca_lang>", language);
+  i = mpc_input_new_string("<mpca_lang>", language, strlen(language));
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3244,7 +3743,12 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
+#ifdef MPC_MMAP
+  i = mpc_input_new_mapped(filename, f);
+  if (i == NULL) { i = mpc_input_new_file(filename, f); }
+#else
   i = mpc_input_new_file(filename, f);
+#endif
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -61,6 +61,7 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_nstring(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
@@ -84,6 +85,8 @@ mpc_parser_t *mpc_new(const char *name);
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a);
 mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 
+int mpc_id(mpc_parser_t *p);
+
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
 
@@ -257,6 +260,7 @@ mpc_parser_t *mpc_re(const char *re);
 
 typedef struct mpc_ast_t {
   char *tag;
+  int id;
   char *contents;
   mpc_state_t state;
   int children_num;
@@ -268,6 +272,7 @@ mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_add_id(mpc_ast_t *a, int id);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
@@ -280,6 +285,33 @@ void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
 */
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
+/*
+** Arenas: `mpc_parse_arena` allocates every AST node, tag,
+** contents and child array from the arena. The result must not be
+** passed to `mpc_ast_delete`; clear or delete the arena instead.
+*/
+
+typedef struct mpc_arena_t mpc_arena_t;
+
+mpc_arena_t *mpc_arena_new(void);
+void mpc_arena_clear(mpc_arena_t *a);
+void mpc_arena_delete(mpc_arena_t *a);
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_arena_t *a);
+
+/*
+** Contexts: `mpc_parse_context` runs on stacks kept in the context,
+** which hold on to their largest size between calls so that parsing
+** many inputs in turn stops reallocating them.
+*/
+
+typedef struct mpc_context_t mpc_context_t;
+
+mpc_context_t *mpc_context_new(void);
+void mpc_context_delete(mpc_context_t *c);
+
+int mpc_parse_context(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_context_t *c);
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
@@ -303,7 +335,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_RULE_IDS             = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -0,0 +1,92 @@
+/* Times mpc on generated Lispy sources of 1, 2, 4 and 8 MB, parsed both
+   from a string and through a pipe. Parsing is linear when the time per
+   MB stays roughly flat as the input doubles.
+
+     cc -std=c11 -O2 mpc.c mpc_bench.c -lm -o mpc_bench && ./mpc_bench */
+
+#include "mpc.h"
+#include <time.h>
+
+static char* bench_source(long size, long* len) {
+  char* src = malloc(size + 128);
+  *len = 0;
+  for (long i = 0; *len < size; i++) {
+    *len += sprintf(src + *len,
+      "(def {x%li} (+ %li {a b} \"str\")) ; note\n", i, i);
+  }
+  return src;
+}
+
+static double bench_seconds(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv) {
+  mpc_parser_t* Number  = mpc_new("number");
+  mpc_parser_t* Symbol  = mpc_new("symbol");
+  mpc_parser_t* String  = mpc_new("string");
+  mpc_parser_t* Comment = mpc_new("comment");
+  mpc_parser_t* Sexpr   = mpc_new("sexpr");
+  mpc_parser_t* Qexpr   = mpc_new("qexpr");
+  mpc_parser_t* Expr    = mpc_new("expr");
+  mpc_parser_t* Lispy   = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                     \
+      number  : /-?[0-9]+/ ;                              \
+      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        \
+      string  : /\"(\\\\.|[^\"])*\"/ ;                    \
+      comment : /;[^\\r\\n]*/ ;                           \
+      sexpr   : '(' <expr>* ')' ;                         \
+      qexpr   : '{' <expr>* '}' ;                         \
+      expr    : <number> | <symbol> | <string>            \
+              | <comment> | <sexpr> | <qexpr> ;           \
+      lispy   : /^/ <expr>* /$/ ;                         \
+    ",
+    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+
+  puts("  size      string    s/MB      pipe      s/MB");
+
+  int status = 0;
+  for (long mb = 1; mb <= 8; mb *= 2) {
+    long len;
+    char* src = bench_source(mb * 1024 * 1024, &len);
+    double mbs = len / (1024.0 * 1024.0);
+
+    mpc_result_t r;
+    clock_t start = clock();
+    if (!mpc_parse("<bench>", src, Lispy, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      free(src);
+      status = 1;
+      break;
+    }
+    double str = bench_seconds(start);
+    mpc_ast_delete(r.output);
+
+    /* A temporary file stands in for the pipe so only parsing is timed */
+    FILE* f = tmpfile();
+    fwrite(src, 1, len, f);
+    rewind(f);
+    start = clock();
+    if (!mpc_parse_pipe("<bench>", f, Lispy, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      fclose(f);
+      free(src);
+      status = 1;
+      break;
+    }
+    double pipe = bench_seconds(start);
+    mpc_ast_delete(r.output);
+    fclose(f);
+    free(src);
+
+    printf("%4.1f MB  %7.3fs  %7.3f  %7.3fs  %7.3f\n",
+      mbs, str, str / mbs, pipe, pipe / mbs);
+  }
+
+  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  return status;
+}
@@ -1,9 +1,28 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "mpc.h"
 #include "prompt.h"
 
-/* NOTE: Comple with cc -std=c99 -Wall mpc.c prompt.c -ledit -o prompt */
+/* NOTE: Comple with cc -std=c11 -Wall mpc.c prompt.c -ledit -lpthread -o prompt */
 
 /* If we are compiling on Windows compile these functions */
 #ifdef _WIN32
@@ -42,7 +61,7 @@ void add_history(char* unused) {}
     if (!(cond)) { \
         lval* err = lval_err(fmt, ##__VA_ARGS__); \
         lval_del(args); \
-        return lval_err(err); \
+        return err; \
     }
 
 #define LASSERT_TYPE(func, args, index, expect) \
@@ -64,47 +83,8 @@ void add_history(char* unused) {}
 
 int main(int argc, char** argv) {
 
-  /* Create Some Parsers */
-  mpc_parser_t* Number = mpc_new("number");
-  mpc_parser_t* Symbol = mpc_new("symbol");
-  mpc_parser_t* String = mpc_new("string");
-  mpc_parser_t* Comment = mpc_new("comment");
-  mpc_parser_t* Sexpr = mpc_new("sexpr");
-  mpc_parser_t* Qexpr = mpc_new("qexpr");
-  mpc_parser_t* Expr = mpc_new("expr");
-  mpc_parser_t* Lispy = mpc_new("lispy");
-
-  /* Define them with the following Language */
-  mpca_lang(MPCA_LANG_DEFAULT,
-      "                                                         \
-        number  : /-?[0-9]+/ ;                                  \
-        symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;            \
-        string  : /\"(\\\\.|[^\"])*\"/ ;                        \
-        comment : /;[^\\t\\n]*/ ;                               \
-        sexpr   : '(' <expr>* ')' ;                             \
-        qexpr   : '{' <expr>* '}' ;                             \
-        expr    : <number> | <symbol> | <sexpr> | <qexpr> ;     \
-        lispy   : /^/ <expr>* /$/ ;                             \
-      ",
-      Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
-  
-
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=", builtin_put);
-  /* Comparison functions */
-  lenv_add_builtin(e, "if", builtin_if);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
-  lenv_add_builtin(e, ">", builtin_gt);
-  lenv_add_builtin(e, "<", builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "<=", builtin_le);
-  lenv_add_builtin(e, "load", builtin_load);
-  lenv_add_builtin(e, "error", builtin_err);
-  lenv_add_builtin(e, "print", builtin_print);
+  /* Create an interpreter with its grammar and builtins */
+  lctx* c = lctx_new();
 
   /* Interactive prompt */
   if (argc == 1) {
@@ -119,19 +99,11 @@ int main(int argc, char** argv) {
         char* input = readline("lispy> ");
         add_history(input);
 
-        /* Attempt to parse the user Input */
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Lispy, &r)) {
-          /* On Success Print the evaluation */
-          lval* x = lval_eval(e, lval_read(r.output));
-          lval_println(x);
-          lval_del(x);
-          mpc_ast_delete(r.output);
-        } else {
-          /* Otherwise print the error */
-          mpc_err_print(r.error);
-          mpc_err_delete(r.error);
-        }
+        /* Read and evaluate the input, syntax errors evaluate to themselves */
+        lval* x = lval_eval(c->env, lval_read_src(c, "<stdin>", input, strlen(input)));
+        lval_println(x);
+        lsched_drain(c);
+        lval_del(x);
 
         free(input);
       }
@@ -145,67 +117,140 @@ int main(int argc, char** argv) {
         lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
         /* Pass to builtin load and get the result */
-        lval* x = builtin_load(e, args);
+        lval* x = builtin_load(c->env, args);
 
         /* If the result is an error be sure to print it */
         if (x->type == LVAL_ERR) { lval_println(x); }
         lval_del(x);
+
+        /* Let any green threads the file spawned run to completion */
+        lsched_drain(c);
     }
   }
 
-  lenv_del(e);
-
-  /* Undefine and Delete our Parsers */
-  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  lctx_del(c);
 
   return 0;
 }
 
-/* Evaluation Functions */
-lval* eval(mpc_ast_t* t) {
-  
-  /* If tagged as a number, return it directly. */
-  if (strstr(t->tag, "number")) {
-    /* Check if there is some error in conversion */
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("Error: Invalid number");
-  }
+/* Interpreter Context
+
+   Everything an interpreter needs lives in its lctx: the grammar, the
+   global environment and the table of hash-consed values. Every
+   environment points back at its context so builtins reach it through
+   the environment they are called with, and separate contexts share no
+   state at all. */
+lctx* lctx_new(void) {
+  lctx* c = malloc(sizeof(lctx));
+
+  /* Hash-consing is off until a script asks for it */
+  c->hashcons = 0;
+  c->interned.count = 0;
+  c->interned.slots = 0;
+  c->interned.orphaned = 0;
+  c->interned.buckets = NULL;
+  pthread_mutex_init(&c->interned.lock, NULL);
+
+  c->pool = NULL;
+  pthread_mutex_init(&c->lock, NULL);
+
+  /* The creating thread's own stack is the first green thread */
+  c->sched.owner = pthread_self();
+  c->sched.current = &c->sched.main;
+  c->sched.head = NULL;
+  c->sched.tail = NULL;
+  c->sched.sleeping = NULL;
+  c->sched.dead = NULL;
+  c->sched.joiner = NULL;
+  c->sched.count = 0;
+  c->sched.epfd = -1;
+  c->sched.waiting = 0;
+  c->sched.fds = NULL;
+  c->sched.nfds = 0;
+  atomic_init(&c->sched.inbox, NULL);
+  c->sched.wakefd = -1;
+
+  atomic_init(&c->sweep.head, NULL);
+  atomic_init(&c->sweep.pending, 0);
+  atomic_init(&c->sweep.started, 0);
+  c->sweep.quit = 0;
+  pthread_mutex_init(&c->sweep.lock, NULL);
+  pthread_cond_init(&c->sweep.wake, NULL);
+  pthread_cond_init(&c->sweep.done, NULL);
 
-  /* The operator is always second child */
-  char* op = t->children[1]->contents;
+  lenv* e = lenv_new();
+  e->ctx = c;
+  c->env = e;
 
-  /* We stor the third child in `x` */
-  lval* x = eval(t->children[2]);
+  lenv_add_builtins(e);
+  lenv_add_builtin(e, "def", builtin_def);
+  lenv_add_builtin(e, "=", builtin_put);
+  /* Comparison functions */
+  lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_builtin(e, "==", builtin_eq);
+  lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, ">", builtin_gt);
+  lenv_add_builtin(e, "<", builtin_lt);
+  lenv_add_builtin(e, ">=", builtin_ge);
+  lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_builtin(e, "load", builtin_load);
+  lenv_add_builtin(e, "error", builtin_err);
+  lenv_add_builtin(e, "print", builtin_print);
 
-  /* Iterate the remaining children and combining. */
-  int i = 3;
-  while (strstr(t->children[i]->tag, "expr")) {
-    x = eval_op(x, op, eval(t->children[i]));
-    i++;
-  }
+  return c;
+}
 
-  return x;
-}
-lval* eval_op(lval* x, char* op, lval* y) {
-  /* If either value is an error return it */
-  if (x->type == LVAL_ERR) { return x; }
-  if (y->type == LVAL_ERR) { return y; }
-
-  /* Otherwise do maths on the number values */
-  if (strcmp(op, "+") == 0) { return lval_num(x->num + y->num); }
-  if (strcmp(op, "-") == 0) { return lval_num(x->num - y->num); }
-  if (strcmp(op, "*") == 0) { return lval_num(x->num * y->num); }
-  if (strcmp(op, "/") == 0) {
-    /* If second operand is zero return error */
-    return y->num == 0
-      ? lval_err("Error: Division by zero") 
-      : lval_num(x->num / y->num);
+void lctx_del(lctx* c) {
+  if (c->pool) { lpool_del(c->pool); }
+  lenv_del(c->env);
+
+  /* Let the sweeper finish this context's garbage, then stop it */
+  lsweep_flush(&c->sweep);
+  pthread_mutex_lock(&c->sweep.lock);
+  c->sweep.quit = 1;
+  pthread_cond_signal(&c->sweep.wake);
+  pthread_mutex_unlock(&c->sweep.lock);
+  if (atomic_load(&c->sweep.started) == 1) { pthread_join(c->sweep.thread, NULL); }
+  pthread_mutex_destroy(&c->sweep.lock);
+  pthread_cond_destroy(&c->sweep.wake);
+  pthread_cond_destroy(&c->sweep.done);
+
+  /* This thread may still name the context from its last evaluation */
+  lctx* cur = lsweep_swap(NULL);
+  if (cur != c) { lsweep_swap(cur); }
+
+  /* Anything still interned is referenced from outside and its holders
+     will release it through the table, so hand the entries to a table
+     of their own that is freed along with the last of them */
+  if (c->interned.count > 0) {
+    ltable* t = malloc(sizeof(ltable));
+    t->count = c->interned.count;
+    t->slots = c->interned.slots;
+    t->orphaned = 1;
+    t->buckets = c->interned.buckets;
+    pthread_mutex_init(&t->lock, NULL);
+    for (int i = 0; i < t->slots; i++) {
+      for (lentry* n = t->buckets[i]; n; n = n->next) {
+        n->key->interned = t;
+      }
+    }
+  } else {
+    free(c->interned.buckets);
   }
+  pthread_mutex_destroy(&c->interned.lock);
+  pthread_mutex_destroy(&c->lock);
+  if (c->sched.epfd != -1) { close(c->sched.epfd); }
+  if (c->sched.wakefd != -1) { close(c->sched.wakefd); }
+  free(c->sched.fds);
 
-  return lval_err("Error: Invalid Operation");
+  free(c);
 }
+
 lval* lval_join(lval* x, lval* y) {
+    /* Both lists are modified so they must not be shared */
+    x = lval_thaw(x);
+    y = lval_thaw(y);
+
     /* For each cell in 'y' add it to 'x' */
     while (y->count) {
         x = lval_add(x, lval_pop(y, 0));
@@ -237,8 +282,8 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
         }
     }
 
-    /* Pop teh first element */
-    lval* x = lval_pop(a, 0);
+    /* Pop teh first element, it is updated in place */
+    lval* x = lval_thaw(lval_pop(a, 0));
 
     /* If no aruguments and sub then perform unary negation */
     if ((strcmp(op, "-") == 0) && a->count == 0) {
@@ -283,11 +328,11 @@ lval* builtin_head(lenv* e, lval* a) {
         "Function 'head' passed {}!");
 
     /* Otherwise take first argument */
-    lval* v = lval_take(a, 0);
+    lval* v = lval_thaw(lval_take(a, 0));
 
     /* Delete all elements that are not head and return */
     while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-    return v;
+    return lval_hashcons(e->ctx, v);
 }
 lval* builtin_tail(lenv* e, lval* a) {
     /* Check Error Condiditons */
@@ -301,15 +346,15 @@ lval* builtin_tail(lenv* e, lval* a) {
         "Function 'tail' passed {}!");
 
     /* Take first argument */
-    lval* v = lval_take(a, 0);
+    lval* v = lval_thaw(lval_take(a, 0));
 
     /* Delete first element and return */
     lval_del(lval_pop(v, 0));
-    return v;
+    return lval_hashcons(e->ctx, v);
 }
 lval* builtin_list(lenv* e, lval* a) {
     a->type = LVAL_QEXPR;
-    return a;
+    return lval_hashcons(e->ctx, a);
 }
 lval* builtin_eval(lenv* e, lval* a) {
     LASSERT(a, a->count == 1, 
@@ -317,7 +362,7 @@ lval* builtin_eval(lenv* e, lval* a) {
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
         "Function 'eval' passed incorrect type!");
 
-    lval* x = lval_take(a, 0);
+    lval* x = lval_thaw(lval_take(a, 0));
     x->type = LVAL_SEXPR;
     return lval_eval(e, x);
 }
@@ -334,7 +379,7 @@ lval* builtin_join(lenv* e, lval* a) {
     }
 
     lval_del(a);
-    return x;
+    return lval_hashcons(e->ctx, x);
 }
 
 /* Math-specific builtins */
@@ -355,12 +400,16 @@ lval* builtin_div(lenv* e, lval* a) {
 lval* lval_num(long x) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_NUM;
+  v->hashed = 0;
+  v->interned = NULL;
   v->num = x;
   return v;
 }
 lval* lval_err(char* fmt, ...) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_ERR;
+  v->hashed = 0;
+  v->interned = NULL;
 
   /* Create a va list and initialize it */
   va_list va;
@@ -383,6 +432,8 @@ lval* lval_err(char* fmt, ...) {
 lval* lval_sexpr(void) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_SEXPR;
+  v->hashed = 0;
+  v->interned = NULL;
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -390,6 +441,8 @@ lval* lval_sexpr(void) {
 lval* lval_sym(char* s) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_SYM;
+    v->hashed = 0;
+    v->interned = NULL;
     v->sym = malloc(strlen(s) + 1);
     strcpy(v->sym, s);
     return v;
@@ -397,6 +450,8 @@ lval* lval_sym(char* s) {
 lval* lval_qexpr(void) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_QEXPR;
+    v->hashed = 0;
+    v->interned = NULL;
     v->count = 0;
     v->cell = NULL;
     return v;
@@ -404,7 +459,11 @@ lval* lval_qexpr(void) {
 lval* lval_fun(lbuiltin func) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_FUN;
+    v->hashed = 0;
+    v->interned = NULL;
     v->builtin = func;
+    v->memo = NULL;
+    v->gen = NULL;
     return v;
 }
 
@@ -412,6 +471,7 @@ lval* lval_fun(lbuiltin func) {
 lval* lval_pop(lval* v, int i) {
     /* Find the item at "i" */
     lval* x = v->cell[i];
+    v->hashed = 0;
 
     /* Shift memory after teh item at "i" over the top */
     memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
@@ -431,6 +491,15 @@ lval* lval_take(lval* v, int i) {
 
 /* Destructor */
 void lval_del(lval* v) {
+  /* Shared values are only freed by the last holder */
+  if (v->interned) {
+    if (atomic_fetch_sub(&v->ref, 1) > 1) { return; }
+    lval_unintern(v);
+  }
+
+  /* Big containers are freed in the background, not on this thread */
+  if (lsweep_defer(v)) { return; }
+
   switch (v->type) {
     /* Do nothing special for number type */
     case LVAL_NUM: break;
@@ -449,56 +518,37 @@ void lval_del(lval* v) {
       free(v->cell);
     break;
     case LVAL_FUN: 
-        if (!v->builtin) {
+        if (v->memo) {
+            lmemo_release(v->memo);
+        } else if (v->gen) {
+            lval_del(v->gen);
+        } else if (!v->builtin) {
             lenv_del(v->env);
             lval_del(v->formals);
             lval_del(v->body);
         }
         break;
     case LVAL_STR: free(v->str); break;
-  }
 
-  /* Free the memory allocated for the "lval" struct itself */
-  free(v);
-}
+    /* Hash tables drop their reference to the shared buckets */
+    case LVAL_MAP: ldict_release(v->dict); break;
 
-/* Read functions */
-lval* lval_read_num(mpc_ast_t* t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ?
-    lval_num(x) : lval_err("invalid number");
-}
-lval* lval_read(mpc_ast_t* t) {
-  
-  /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-
-  /* If root (>) or sexpr then create empty list */
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
-
-  /* Fill this list with any valid expresson contained within */
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-    if (strstr(t->tag, "string")) { return lval_read_str(t); }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+    /* Persistent maps only drop their reference to the shared trie */
+    case LVAL_PMAP: lhamt_release(v->root); break;
+    case LVAL_SEQ: lseq_release(v->seq); break;
+    case LVAL_FUTURE: lfuture_release(v->fut); break;
+    case LVAL_ACTOR: lactor_release(v->actor); break;
+    case LVAL_ATOM: latom_release(v->atom); break;
+    case LVAL_CHAN: lchan_release(v->chan); break;
   }
 
-  return x;
+  /* Free the memory allocated for the "lval" struct itself */
+  free(v);
 }
 
 /* Add an lval to a list */
 lval* lval_add(lval* v, lval* x) {
+  v->hashed = 0;
   v->count++;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
@@ -507,6 +557,9 @@ lval* lval_add(lval* v, lval* x) {
 
 /* Copy for functions */
 lval* lval_copy(lval* v) {
+    /* Shared values are immutable so copying just takes a reference */
+    if (v->interned) { v->ref++; return v; }
+
     lval* x = malloc(sizeof(lval));
     x->type = v->type;
 
@@ -514,8 +567,17 @@ lval* lval_copy(lval* v) {
 
         /* Copy functions and numbers directly */
         case LVAL_FUN:
+            x->memo = v->memo;
+            x->gen = NULL;
             if (v->builtin) {
                 x->builtin = v->builtin;
+            } else if (v->memo) {
+                /* Memoized functions share one cache between copies */
+                x->builtin = NULL;
+                x->memo->ref++;
+            } else if (v->gen) {
+                x->builtin = NULL;
+                x->gen = lval_copy(v->gen);
             } else {
                 x->builtin = NULL;
                 x->env = lenv_copy(v->env);
@@ -528,7 +590,11 @@ lval* lval_copy(lval* v) {
         /* Copy strings using malloc and strcpy */
         case LVAL_ERR:
             x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->sym, v->sym); 
+            strcpy(x->err, v->err); 
+            break;
+        case LVAL_SYM:
+            x->sym = malloc(strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
             break;
 
         /* Copy lists by copying each sub-expression */
@@ -545,8 +611,49 @@ lval* lval_copy(lval* v) {
             strcpy(x->str, v->str);
             break;
 
+        /* Hash tables share their buckets until one copy is changed */
+        case LVAL_MAP:
+            x->count = v->count;
+            x->dict = v->dict;
+            x->dict->ref++;
+            break;
+
+        /* Persistent maps share their trie, so copying is O(1) */
+        case LVAL_PMAP:
+            x->count = v->count;
+            x->root = v->root;
+            if (x->root) { x->root->ref++; }
+            break;
+
+        /* Sequences are immutable descriptions so they are shared too */
+        case LVAL_SEQ:
+            x->seq = v->seq;
+            x->seq->ref++;
+            break;
+        case LVAL_FUTURE:
+            x->fut = v->fut;
+            x->fut->ref++;
+            break;
+        case LVAL_ACTOR:
+            x->actor = v->actor;
+            x->actor->ref++;
+            break;
+        case LVAL_ATOM:
+            x->atom = v->atom;
+            x->atom->ref++;
+            break;
+        case LVAL_CHAN:
+            x->chan = v->chan;
+            x->chan->ref++;
+            break;
+
     }
 
+    /* The copy is structurally equal so any cached hash still holds */
+    x->hash = v->hash;
+    x->hashed = v->hashed;
+    x->interned = NULL;
+
     return x;
 }
 
@@ -561,12 +668,28 @@ void lval_print(lval* v) {
     case LVAL_FUN: 
         if (v->builtin) { 
             printf("<function>"); 
+        } else if (v->memo) {
+            printf("(memo "); lval_print(v->memo->fun); putchar(')');
+        } else if (v->gen) {
+            printf("(gen "); lval_print(v->gen); putchar(')');
         } else {
             printf("(\\ "); lval_print(v->formals);
             putchar(' '); lval_print(v->body); putchar(')');
         }
         break;
     case LVAL_STR: lval_print_str(v); break;
+    case LVAL_MAP:
+    case LVAL_PMAP: lval_map_print(v); break;
+    case LVAL_SEQ: printf("<sequence>"); break;
+    case LVAL_FUTURE: printf(v->fut->remaining ? "<future>" : "<future done>"); break;
+    case LVAL_ACTOR: printf("<actor>"); break;
+    case LVAL_CHAN: printf(v->chan->closed ? "<channel closed>" : "<channel>"); break;
+    case LVAL_ATOM: {
+        lval* x = latom_deref(v->atom);
+        printf("(atom "); lval_print(x); putchar(')');
+        lval_del(x);
+        break;
+    }
   }
 }
 void lval_expr_print(lval* v, char open, char close) {
@@ -590,6 +713,7 @@ void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 /* Variable Environment Constructor and Destructor */
 lenv* lenv_new(void) {
     lenv* e = malloc(sizeof(lenv));
+    e->ctx = NULL;
     e->par = NULL;
     e->count = 0;
     e->syms = NULL;
@@ -610,22 +734,33 @@ void lenv_del(lenv* e) {
 /* Variable environment Getter and Setter */
 lval* lenv_get(lenv* e, lval* k) {
 
-    /* Iterate over all items in the environment */
-    for (int i = 0; i < e->count; i++) {
-        /* Check if the stored string matches the symbol string */
-        /* If it does, return a copy of the value */
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+    /* Parents are walked in a loop, since calls nest their environments
+       and a deep recursion would otherwise need as deep a C stack here */
+    for (; e; e = e->par) {
+        /* Iterate over all items in the environment */
+        for (int i = 0; i < e->count; i++) {
+            /* Check if the stored string matches the symbol string */
+            /* If it does, return a copy of the value */
+            if (strcmp(e->syms[i], k->sym) == 0) {
+                return lval_copy(e->vals[i]);
+            }
         }
     }
-    /* If no symbol found check in parent otherwise return error */
-    if (e->par) {
-        return lenv_get(e->par, k);
-    }
 
+    /* If no symbol found in any parent return error */
     return lval_err("Unfound symbol '%s'", k->sym);
 }
 
+/* Where the value bound to k is stored, for builtins changing it in place */
+lval** lenv_slot(lenv* e, lval* k) {
+    for (; e; e = e->par) {
+        for (int i = 0; i < e->count; i++) {
+            if (strcmp(e->syms[i], k->sym) == 0) { return &e->vals[i]; }
+        }
+    }
+    return NULL;
+}
+
 void lenv_put(lenv* e, lval* k, lval* v) {
 
     /* Iterate over all items in the environmnet */
@@ -637,6 +772,7 @@ void lenv_put(lenv* e, lval* k, lval* v) {
         if (strcmp(e->syms[i], k->sym) == 0) {
             lval_del(e->vals[i]);
             e->vals[i] = lval_copy(v);
+            lval_hash(e->vals[i]);
             return;
         }
     }
@@ -648,6 +784,7 @@ void lenv_put(lenv* e, lval* k, lval* v) {
 
     /* Copy contents of lval and symbol string into new location */
     e->vals[e->count-1] = lval_copy(v);
+    lval_hash(e->vals[e->count-1]);
     e->syms[e->count-1] = malloc(strlen(k->sym)+1);
     strcpy(e->syms[e->count-1], k->sym);
 }
@@ -658,11 +795,32 @@ lval* lval_eval(lenv* e, lval* v) {
         lval_del(v);
         return x;
     }
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+    if (v->type == LVAL_SEXPR) {
+        /* Coroutine stacks are bounded, so fail before running off one */
+        if (lstack_exhausted()) {
+            lval_del(v);
+            return lval_err("Stack overflow, calls are nested too deeply.");
+        }
+
+        /* Values dropped during the call go to this context's sweeper */
+        lctx* outer = lsweep_swap(e->ctx);
+        lval* r = lval_eval_sexpr(e, lval_thaw(v));
+        lsweep_swap(outer);
+        return r;
+    }
     return v;
 }
 
+/* Map constructors build an empty map when called alone, where any
+   other lone value just evaluates to itself */
+static int lval_nullary(lval* f) {
+    return f->type == LVAL_FUN
+        && (f->builtin == builtin_dict || f->builtin == builtin_pdict);
+}
+
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+    /* Elements are replaced in place so drop any cached hash */
+    v->hashed = 0;
     for (int i = 0; i < v->count; i++) {
         v->cell[i] = lval_eval(e, v->cell[i]);
     }
@@ -671,7 +829,7 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
     }
 
     if (v->count == 0) { return v; }
-    if (v->count == 1) { return lval_take(v, 0); }
+    if (v->count == 1 && !lval_nullary(v->cell[0])) { return lval_take(v, 0); }
 
     /* Ensure first element is a function after evaluation */
     lval* f = lval_pop(v, 0);
@@ -710,6 +868,71 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
+
+    /* Dictionary Functions */
+    lenv_add_builtin(e, "dict", builtin_dict);
+    lenv_add_builtin(e, "pdict", builtin_pdict);
+    lenv_add_builtin(e, "get", builtin_get);
+    lenv_add_builtin(e, "put", builtin_assoc);
+    lenv_add_builtin(e, "del", builtin_dissoc);
+    lenv_add_builtin(e, "put!", builtin_map_set);
+    lenv_add_builtin(e, "del!", builtin_map_unset);
+    lenv_add_builtin(e, "keys", builtin_keys);
+    lenv_add_builtin(e, "size", builtin_size);
+    lenv_add_builtin(e, "hashcons", builtin_hashcons);
+
+    /* Function Functions */
+    lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+    lenv_add_builtin(e, "gen", builtin_gen);
+
+    /* Sequence Functions */
+    lenv_add_builtin(e, "range", builtin_range);
+    lenv_add_builtin(e, "iterate", builtin_iterate);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "fold", builtin_fold);
+    lenv_add_builtin(e, "collect", builtin_collect);
+
+    /* Parallel Functions */
+    lenv_add_builtin(e, "pmap", builtin_pmap);
+    lenv_add_builtin(e, "preduce", builtin_preduce);
+    lenv_add_builtin(e, "future", builtin_future);
+    lenv_add_builtin(e, "await", builtin_await);
+
+    /* Actor Functions */
+    lenv_add_builtin(e, "actor", builtin_actor);
+    lenv_add_builtin(e, "send", builtin_send);
+    lenv_add_builtin(e, "state", builtin_state);
+
+    /* Atom Functions */
+    lenv_add_builtin(e, "atom", builtin_atom);
+    lenv_add_builtin(e, "deref", builtin_deref);
+    lenv_add_builtin(e, "swap!", builtin_swap);
+    lenv_add_builtin(e, "reset!", builtin_reset);
+    lenv_add_builtin(e, "cas!", builtin_cas);
+
+    /* Channel Functions, send and close also take channels */
+    lenv_add_builtin(e, "chan", builtin_chan);
+    lenv_add_builtin(e, "recv", builtin_recv);
+    lenv_add_builtin(e, "select", builtin_select);
+
+    /* Green Thread Functions */
+    lenv_add_builtin(e, "spawn", builtin_spawn);
+    lenv_add_builtin(e, "yield", builtin_yield);
+    lenv_add_builtin(e, "sleep", builtin_sleep);
+
+    /* I/O Functions */
+    lenv_add_builtin(e, "open", builtin_open);
+    lenv_add_builtin(e, "read", builtin_read);
+    lenv_add_builtin(e, "write", builtin_write);
+    lenv_add_builtin(e, "close", builtin_close);
+    lenv_add_builtin(e, "listen", builtin_listen);
+    lenv_add_builtin(e, "accept", builtin_accept);
+    lenv_add_builtin(e, "connect", builtin_connect);
+    lenv_add_builtin(e, "after", builtin_after);
 }
 
 /* Builtin to define functions */
@@ -740,7 +963,7 @@ lval* builtin_def(lenv* e, lval* a) {
     lval_del(a);
     return lval_sexpr();
 }
-lval* builtin_put(lenv* e, lval* a, char* func) {
+lval* builtin_put(lenv* e, lval* a) {
     return builtin_var(e, a, "=");
 }
 lval* builtin_var(lenv* e, lval* a, char* func) {
@@ -788,6 +1011,13 @@ char* ltype_name(int t) {
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
         case LVAL_STR: return "String";
+        case LVAL_MAP: return "Dictionary";
+        case LVAL_PMAP: return "Persistent Dictionary";
+        case LVAL_SEQ: return "Sequence";
+        case LVAL_FUTURE: return "Future";
+        case LVAL_ACTOR: return "Actor";
+        case LVAL_ATOM: return "Atom";
+        case LVAL_CHAN: return "Channel";
         default: return "Unknown";
     }
 }
@@ -795,15 +1025,19 @@ char* ltype_name(int t) {
 lval* lval_lambda(lval* formals, lval* body) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_FUN;
+    v->hashed = 0;
+    v->interned = NULL;
 
     /* Set Builtin to Null */
     v->builtin = NULL;
+    v->memo = NULL;
+    v->gen = NULL;
     
     /* Build new environmnet */
     v->env = lenv_new();
 
-    /* Set formals and Body */
-    v->formals = formals;
+    /* Set formals and Body, formals are consumed by calls */
+    v->formals = lval_thaw(formals);
     v->body = body;
     return v;
 }
@@ -831,6 +1065,7 @@ lval* builtin_lambda(lenv* e, lval* a) {
 
 lenv* lenv_copy(lenv* e) {
     lenv* n = malloc(sizeof(lenv));
+    n->ctx = e->ctx;
     n->par = e->par;
     n->count = e->count;
     n->syms = malloc(sizeof(char*) * n->count);
@@ -855,6 +1090,12 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     /* If builtin then simply call that */
     if (f->builtin) { return f->builtin(e,a); }
 
+    /* If memoized look in the cache first */
+    if (f->memo) { return lmemo_call(e, f->memo, a); }
+
+    /* Generators return a sequence that runs the body as it is pulled */
+    if (f->gen) { return lgen_call(e, f->gen, a); }
+
     /* Record argument counts */
     int given = a->count;
     int total = f->formals->count;
@@ -925,6 +1166,7 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     if (f->formals->count == 0) {
         /* Set environment parent to evaltuation parent */
         f->env->par = e;
+        f->env->ctx = e->ctx;
 
         /* Evaluate and return */
         return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
@@ -975,6 +1217,11 @@ int lval_eq(lval* x, lval* y) {
     /* Different Types are always unequal */
     if (x->type != y->type) { return 0; }
 
+    /* Cached hashes that differ mean the values cannot be equal */
+    if (x == y) { return 1; }
+    if (x->interned && x->interned == y->interned) { return 0; }
+    if (x->hashed && y->hashed && x->hash != y->hash) { return 0; }
+
     /* Compare based upon type */
     switch (x->type) {
         /* Compare number value */
@@ -988,6 +1235,10 @@ int lval_eq(lval* x, lval* y) {
         case LVAL_FUN:
             if (x->builtin || y->builtin) {
                 return x->builtin == y->builtin;
+            } else if (x->memo || y->memo) {
+                return x->memo == y->memo;
+            } else if (x->gen || y->gen) {
+                return x->gen && y->gen && lval_eq(x->gen, y->gen);
             } else {
                 return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
             }
@@ -1004,6 +1255,17 @@ int lval_eq(lval* x, lval* y) {
             return 1;
             break;
         case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+
+        /* Maps are equal if they hold equal values under the same keys */
+        case LVAL_MAP:
+        case LVAL_PMAP: return lval_map_eq(x, y);
+
+        /* Sequences are only equal to themselves */
+        case LVAL_SEQ: return x->seq == y->seq;
+        case LVAL_FUTURE: return x->fut == y->fut;
+        case LVAL_ACTOR: return x->actor == y->actor;
+        case LVAL_ATOM: return x->atom == y->atom;
+        case LVAL_CHAN: return x->chan == y->chan;
     }
     return 0;
 }
@@ -1033,6 +1295,8 @@ lval* builtin_if(lenv* e, lval* a) {
 
     /* Mark both expressions as evaluable */
     lval* x;
+    a->cell[1] = lval_thaw(a->cell[1]);
+    a->cell[2] = lval_thaw(a->cell[2]);
     a->cell[1]->type = LVAL_SEXPR;
     a->cell[2]->type = LVAL_SEXPR;
 
@@ -1053,6 +1317,8 @@ lval* builtin_if(lenv* e, lval* a) {
 lval* lval_str(char* s) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_STR;
+    v->hashed = 0;
+    v->interned = NULL;
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
     return v;
@@ -1068,60 +1334,257 @@ void lval_print_str (lval* v) {
     /* free the copied string */
     free(escaped);
 }
-lval* lval_read_str(mpc_ast_t* t) {
-    /* Cut off the final quote character */
-    t->contents[strlen(t->contents)-1] = '\0';
-    /* Copy the string missing out of the first quote character */
-    char* unescaped = malloc(strlen(t->contents+1)+1);
-    strcpy(unescaped, t->contents+1);
-    /* Pass through the unescape funtion */
-    unescaped = mpcf_unescape(unescaped);
-    /* Construct a new lval using the string */
-    lval* str = lval_str(unescaped);
-    /* Free the string and return */
-    free(unescaped);
-    return str;
+
+/* Direct reader
+
+   Scans source text once and builds lvals as it goes, without a parse
+   tree in between. It accepts numbers, symbols, double quoted strings
+   with backslash escapes, comments from ; to the end of the line, and
+   S-Expressions and Q-Expressions in () and {}. Errors are reported
+   the way mpc reports them, with the row and column where reading
+   stopped. */
+typedef struct {
+    lctx* c;
+    const char* filename;
+    const char* p;
+    const char* end;
+    const char* line;
+    long row;
+    lval* err;
+} lreader;
+
+static int lread_symchar(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+        || (ch >= '0' && ch <= '9') || (ch && strchr("_+-*/\\=<>!&", ch));
 }
 
-lval* builtin_load(lenv* e, lval* a) {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
+static void lread_error(lreader* r, const char* expected) {
+    char got[16];
+    if (r->p >= r->end) {
+        strcpy(got, "end of input");
+    } else if (*r->p == '\n') {
+        strcpy(got, "'\\n'");
+    } else {
+        snprintf(got, sizeof(got), "'%c'", *r->p);
+    }
+    r->err = lval_err("%s:%li:%li: error: expected %s at %s",
+        r->filename, r->row + 1, (long)(r->p - r->line) + 1, expected, got);
+}
 
-    /* Parse file given by string name */
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        /* Read contents */
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
-
-        /* Evaluate each expression */
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
-            /* If evaluation leads to error, print it */
-            if (x->type == LVAL_ERR) { lval_println(x); }
+/* Skip whitespace and comments, which run to the end of the line */
+static void lread_space(lreader* r) {
+    while (r->p < r->end) {
+        char ch = *r->p;
+        if (ch == '\n') {
+            r->p++;
+            r->row++;
+            r->line = r->p;
+        } else if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f' || ch == '\v') {
+            r->p++;
+        } else if (ch == ';') {
+            while (r->p < r->end && *r->p != '\n' && *r->p != '\t') { r->p++; }
+        } else {
+            break;
+        }
+    }
+}
+
+static lval* lread_expr(lreader* r);
+
+/* Read expressions into x until the closing character */
+static lval* lread_list(lreader* r, lval* x, char close) {
+    for (;;) {
+        lread_space(r);
+        if (r->p < r->end && *r->p == close) {
+            r->p++;
+            return x;
+        }
+        if (r->p >= r->end && !close) { return x; }
+
+        lval* y = lread_expr(r);
+        if (!y) {
+            if (!r->err) {
+                lread_error(r, close == ')' ? "expression or ')'"
+                             : close == '}' ? "expression or '}'"
+                             : "expression or end of input");
+            }
             lval_del(x);
+            return NULL;
         }
+        x = lval_add(x, y);
+    }
+}
 
-        /* Delete expressions and arguments */
-        lval_del(expr);
-        lval_del(a);
+static lval* lread_expr(lreader* r) {
+    if (r->p >= r->end) { return NULL; }
+    const char* start = r->p;
+    char ch = *start;
 
-        /* Return empty list */
-        return lval_sexpr();
+    if (ch == '(') {
+        r->p++;
+        lval* x = lread_list(r, lval_sexpr(), ')');
+        return x ? lval_hashcons(r->c, x) : NULL;
+    }
+    if (ch == '{') {
+        r->p++;
+        lval* x = lread_list(r, lval_qexpr(), '}');
+        return x ? lval_hashcons(r->c, x) : NULL;
+    }
 
-    } else {
-        /* Get parse error as string */
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+    if (ch == '"') {
+        /* Find the closing quote, skipping escaped characters */
+        const char* q = start + 1;
+        while (q < r->end && *q != '"') {
+            if (*q == '\\' && q + 1 < r->end) { q++; }
+            if (*q == '\n') { r->row++; r->line = q + 1; }
+            q++;
+        }
+        if (q >= r->end) {
+            r->p = q;
+            lread_error(r, "'\"'");
+            return NULL;
+        }
+        r->p = q + 1;
+
+        char* unescaped = malloc(q - start);
+        memcpy(unescaped, start + 1, q - start - 1);
+        unescaped[q - start - 1] = '\0';
+        unescaped = mpcf_unescape(unescaped);
+        lval* x = lval_str(unescaped);
+        free(unescaped);
+        return lval_hashcons(r->c, x);
+    }
 
-        /* Create new error message using it */
-        lval* err = lval_err("Could not load library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+    /* A number is an optional minus then digits, as in the grammar it is
+       tried before a symbol so "-5" is a number and "-" a symbol */
+    const char* q = start + (ch == '-');
+    if (q < r->end && *q >= '0' && *q <= '9') {
+        while (q < r->end && *q >= '0' && *q <= '9') { q++; }
+        r->p = q;
+
+        /* Accumulate the digits here rather than with strtol, which would
+           run past the end of source that is not terminated */
+        int neg = ch == '-', range = 0;
+        long x = 0;
+        for (const char* d = start + neg; d < q; d++) {
+            int digit = *d - '0';
+            if (neg ? x < (LONG_MIN + digit) / 10 : x > (LONG_MAX - digit) / 10) { range = 1; break; }
+            x = neg ? x * 10 - digit : x * 10 + digit;
+        }
+        return lval_hashcons(r->c,
+            !range ? lval_num(x) : lval_err("invalid number"));
+    }
+
+    if (lread_symchar(ch)) {
+        q = start;
+        while (q < r->end && lread_symchar(*q)) { q++; }
+        r->p = q;
+
+        char* sym = malloc(q - start + 1);
+        memcpy(sym, start, q - start);
+        sym[q - start] = '\0';
+        lval* x = lval_sym(sym);
+        free(sym);
+        return lval_hashcons(r->c, x);
+    }
 
-        /* Cleanup and return error */
+    return NULL;
+}
+
+/* Read every expression in src into an S-Expression, or return an error */
+lval* lval_read_src(lctx* c, const char* filename, const char* src, long len) {
+    lreader r;
+    r.c = c;
+    r.filename = filename;
+    r.p = src;
+    r.end = src + len;
+    r.line = src;
+    r.row = 0;
+    r.err = NULL;
+
+    lval* x = lread_list(&r, lval_sexpr(), '\0');
+    return x ? lval_hashcons(c, x) : r.err;
+}
+
+/* Library files are mapped read only and read front to back, so loading
+   them costs page faults rather than copies. Pipes, devices and empty files
+   can't be mapped and are read into a buffer instead. */
+char* lval_load_src(const char* path, long* len, int* mapped) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) { return NULL; }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char* src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src != MAP_FAILED) {
+            madvise(src, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *len = st.st_size;
+            *mapped = 1;
+            return src;
+        }
+    }
+
+    long size = 0, cap = 4096;
+    char* src = malloc(cap);
+    for (;;) {
+        if (size == cap) { cap *= 2; src = realloc(src, cap); }
+        ssize_t n = read(fd, src + size, cap - size);
+        if (n == -1 && errno == EINTR) { continue; }
+        if (n == -1) {
+            int err = errno;
+            free(src);
+            close(fd);
+            errno = err;
+            return NULL;
+        }
+        if (n == 0) { break; }
+        size += n;
+    }
+    close(fd);
+    *len = size;
+    *mapped = 0;
+    return src;
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    /* Map the file, or read it if it is not a regular file */
+    char* path = a->cell[0]->str;
+    long len;
+    int mapped;
+    char* src = lval_load_src(path, &len, &mapped);
+    LASSERT(a, src, "Could not load library %s: error: %s", path, strerror(errno));
+
+    /* Parse it straight into expressions */
+    lval* expr = lval_read_src(e->ctx, path, src, len);
+    if (mapped) { munmap(src, len); } else { free(src); }
+    if (expr->type == LVAL_ERR) {
+        lval* err = lval_err("Could not load library %s", expr->err);
+        lval_del(expr);
+        lval_del(a);
         return err;
     }
+    expr = lval_thaw(expr);
+
+    /* Evaluate each expression in order, taking them by index rather than
+       popping the front so big files don't shift the rest every time */
+    for (int i = 0; i < expr->count; i++) {
+        lval* x = lval_eval(e, expr->cell[i]);
+        /* If evaluation leads to error, print it */
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+    }
+    expr->count = 0;
+
+    /* Delete expressions and arguments */
+    lval_del(expr);
+    lval_del(a);
+
+    /* Return empty list */
+    return lval_sexpr();
 }
 lval* builtin_print(lenv* e, lval* a) {
     /* Print each argument followed by a space */
@@ -1146,3 +1609,3223 @@ lval* builtin_err(lenv* e, lval* a) {
     lval_del(a);
     return err;
 }
+
+/* Hashing functions */
+uint64_t lhash_str(char* s) {
+    /* FNV-1a over the bytes of the string */
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+uint64_t lhash_mix(uint64_t h, uint64_t x) {
+    h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+uint64_t lval_hash(lval* v) {
+    /* Reuse the hash if it was computed since the value last changed */
+    if (v->hashed) { return v->hash; }
+
+    /* Start from the type so that equal contents of different types differ */
+    uint64_t h = lhash_mix(0, v->type);
+
+    switch (v->type) {
+        /* Numbers and functions are cheap or mutable so never cached */
+        case LVAL_NUM: return lhash_mix(h, (uint64_t)v->num * 0xff51afd7ed558ccdULL);
+        case LVAL_ERR: h = lhash_mix(h, lhash_str(v->err)); break;
+        case LVAL_SYM: h = lhash_mix(h, lhash_str(v->sym)); break;
+        case LVAL_STR: h = lhash_mix(h, lhash_str(v->str)); break;
+
+        /* Builtins hash by address, lambdas by formals and body */
+        case LVAL_FUN:
+            if (v->builtin) { return lhash_mix(h, (uint64_t)(uintptr_t)v->builtin); }
+            if (v->memo) { return lhash_mix(h, (uint64_t)(uintptr_t)v->memo); }
+            if (v->gen) { return lhash_mix(h, lval_hash(v->gen)); }
+            h = lhash_mix(h, lval_hash(v->formals));
+            return lhash_mix(h, lval_hash(v->body));
+
+        /* Lists hash every element in order. Both kinds of list share a
+           seed as builtins switch between them in place and lval_eq
+           compares the type anyway */
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            h = lhash_mix(0, LVAL_QEXPR);
+            for (int i = 0; i < v->count; i++) {
+                h = lhash_mix(h, lval_hash(v->cell[i]));
+            }
+            break;
+
+        /* Maps combine their entries without depending on order. Hash
+           tables keep that sum up to date as entries change. */
+        case LVAL_MAP: h = lhash_mix(h, v->dict->sum); break;
+        case LVAL_PMAP: h = lhash_mix(h, lhamt_hash(v->root)); break;
+        case LVAL_SEQ: return lhash_mix(h, (uint64_t)(uintptr_t)v->seq);
+        case LVAL_FUTURE: return lhash_mix(h, (uint64_t)(uintptr_t)v->fut);
+        case LVAL_ACTOR: return lhash_mix(h, (uint64_t)(uintptr_t)v->actor);
+        case LVAL_ATOM: return lhash_mix(h, (uint64_t)(uintptr_t)v->atom);
+        case LVAL_CHAN: return lhash_mix(h, (uint64_t)(uintptr_t)v->chan);
+    }
+
+    v->hash = h;
+    v->hashed = 1;
+    return h;
+}
+
+/* Hash table map
+
+   Copies of a table share its buckets, so passing a dictionary around
+   or looking a variable up is O(1). The table is only copied when it is
+   changed while another copy still holds it. put passes its argument,
+   which the caller's variable still shares, so building a table from a
+   lambda should use put! on the variable instead. */
+static ldict* ldict_new(int slots) {
+    ldict* t = malloc(sizeof(ldict));
+    atomic_init(&t->ref, 1);
+    t->slots = slots;
+    t->buckets = calloc(slots, sizeof(lentry*));
+    t->sum = 0;
+    return t;
+}
+void ldict_release(ldict* t) {
+    if (atomic_fetch_sub(&t->ref, 1) > 1) { return; }
+
+    /* Free every entry and the bucket array */
+    for (int i = 0; i < t->slots; i++) {
+        lentry* n = t->buckets[i];
+        while (n) {
+            lentry* next = n->next;
+            lval_del(n->key); lval_del(n->val); free(n);
+            n = next;
+        }
+    }
+    free(t->buckets);
+    free(t);
+}
+lval* lval_dict(void) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_MAP;
+    v->hashed = 0;
+    v->interned = NULL;
+    v->count = 0;
+    v->dict = ldict_new(8);
+    return v;
+}
+void lval_dict_own(lval* d) {
+    /* Sole holders change the table in place, others copy it first */
+    ldict* t = d->dict;
+    if (atomic_load(&t->ref) == 1) { return; }
+
+    ldict* c = ldict_new(t->slots);
+    c->sum = t->sum;
+    for (int i = 0; i < t->slots; i++) {
+        for (lentry* n = t->buckets[i]; n; n = n->next) {
+            lentry* x = malloc(sizeof(lentry));
+            x->hash = n->hash;
+            x->key = lval_copy(n->key);
+            x->val = lval_copy(n->val);
+            x->next = c->buckets[i];
+            c->buckets[i] = x;
+        }
+    }
+    ldict_release(t);
+    d->dict = c;
+}
+lval* lval_dict_get(lval* d, lval* k, uint64_t h) {
+    /* Walk the chain for this bucket looking for an equal key */
+    ldict* t = d->dict;
+    for (lentry* n = t->buckets[h & (t->slots-1)]; n; n = n->next) {
+        if (n->hash == h && lval_eq(n->key, k)) { return n->val; }
+    }
+    return NULL;
+}
+void lval_dict_set(lval* d, lval* k, lval* v) {
+    uint64_t h = lval_hash(k);
+    lval_dict_own(d);
+    ldict* t = d->dict;
+
+    /* If the key exists replace its value */
+    for (lentry* n = t->buckets[h & (t->slots-1)]; n; n = n->next) {
+        if (n->hash == h && lval_eq(n->key, k)) {
+            t->sum -= lhash_mix(h, lval_hash(n->val));
+            t->sum += lhash_mix(h, lval_hash(v));
+            lval_del(n->val); lval_del(k);
+            n->val = v;
+            d->hashed = 0;
+            return;
+        }
+    }
+
+    /* Otherwise push a new entry onto the front of the chain */
+    lentry* n = malloc(sizeof(lentry));
+    n->hash = h;
+    n->key = k;
+    n->val = v;
+    n->next = t->buckets[h & (t->slots-1)];
+    t->buckets[h & (t->slots-1)] = n;
+    t->sum += lhash_mix(h, lval_hash(v));
+    d->count++;
+    d->hashed = 0;
+
+    /* Keep the load factor below 3/4 */
+    if (d->count * 4 > t->slots * 3) { lval_dict_grow(d); }
+}
+int lval_dict_remove(lval* d, lval* k) {
+    uint64_t h = lval_hash(k);
+    if (!lval_dict_get(d, k, h)) { return 0; }
+    lval_dict_own(d);
+    ldict* t = d->dict;
+    lentry** link = &t->buckets[h & (t->slots-1)];
+    while (*link) {
+        lentry* n = *link;
+        if (n->hash == h && lval_eq(n->key, k)) {
+            *link = n->next;
+            t->sum -= lhash_mix(h, lval_hash(n->val));
+            lval_del(n->key); lval_del(n->val); free(n);
+            d->count--;
+            d->hashed = 0;
+            return 1;
+        }
+        link = &n->next;
+    }
+    return 0;
+}
+void lval_dict_grow(lval* d) {
+    /* Double the bucket array and rehash using the stored hashes */
+    ldict* t = d->dict;
+    int slots = t->slots * 2;
+    lentry** buckets = calloc(slots, sizeof(lentry*));
+    for (int i = 0; i < t->slots; i++) {
+        lentry* n = t->buckets[i];
+        while (n) {
+            lentry* next = n->next;
+            n->next = buckets[n->hash & (slots-1)];
+            buckets[n->hash & (slots-1)] = n;
+            n = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->slots = slots;
+}
+
+/* Persistent map */
+lval* lval_pdict(void) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_PMAP;
+    v->hashed = 0;
+    v->interned = NULL;
+    v->count = 0;
+    v->root = NULL;
+    return v;
+}
+
+/* Number of set bits, used to find a slot from the bitmap */
+static int lhamt_popcount(uint32_t x) {
+    int c = 0;
+    while (x) { x &= x - 1; c++; }
+    return c;
+}
+
+/* Nodes below the last 5-bit chunk of the hash hold colliding keys */
+#define LHAMT_BITS 5
+#define LHAMT_COLLISION(shift) ((shift) >= 64)
+
+lhamt* lhamt_new(int count) {
+    lhamt* n = malloc(sizeof(lhamt));
+    n->ref = 1;
+    n->count = count;
+    n->bitmap = 0;
+    n->hashed = 0;
+    n->slots = count ? malloc(sizeof(lslot) * count) : NULL;
+    return n;
+}
+lhamt* lhamt_clone(lhamt* n) {
+    /* Shallow copy a node: children are shared, entries are copied */
+    lhamt* c = lhamt_new(n->count);
+    c->bitmap = n->bitmap;
+    for (int i = 0; i < n->count; i++) {
+        c->slots[i] = n->slots[i];
+        if (n->slots[i].sub) {
+            n->slots[i].sub->ref++;
+        } else {
+            c->slots[i].key = lval_copy(n->slots[i].key);
+            c->slots[i].val = lval_copy(n->slots[i].val);
+        }
+    }
+    return c;
+}
+void lhamt_release(lhamt* n) {
+    if (!n || --n->ref > 0) { return; }
+    for (int i = 0; i < n->count; i++) {
+        if (n->slots[i].sub) {
+            lhamt_release(n->slots[i].sub);
+        } else {
+            lval_del(n->slots[i].key);
+            lval_del(n->slots[i].val);
+        }
+    }
+    free(n->slots);
+    free(n);
+}
+lval* lhamt_get(lhamt* n, uint64_t h, lval* k, int shift) {
+    while (n) {
+        /* Collision nodes are searched linearly */
+        if (LHAMT_COLLISION(shift)) {
+            for (int i = 0; i < n->count; i++) {
+                if (lval_eq(n->slots[i].key, k)) { return n->slots[i].val; }
+            }
+            return NULL;
+        }
+
+        uint32_t bit = 1u << ((h >> shift) & 31);
+        if (!(n->bitmap & bit)) { return NULL; }
+        lslot* s = &n->slots[lhamt_popcount(n->bitmap & (bit-1))];
+
+        /* Either descend into the child or compare the leaf */
+        if (s->sub) {
+            n = s->sub;
+            shift += LHAMT_BITS;
+        } else {
+            return (s->hash == h && lval_eq(s->key, k)) ? s->val : NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Insert a slot at position pos of a copy of n (n may be NULL) */
+static lhamt* lhamt_insert(lhamt* n, int pos, uint32_t bit, lslot s) {
+    int count = n ? n->count : 0;
+    lhamt* c = lhamt_new(count + 1);
+    c->bitmap = (n ? n->bitmap : 0) | bit;
+    for (int i = 0, j = 0; i < count + 1; i++) {
+        if (i == pos) { c->slots[i] = s; continue; }
+        c->slots[i] = n->slots[j];
+        if (c->slots[i].sub) {
+            c->slots[i].sub->ref++;
+        } else {
+            c->slots[i].key = lval_copy(n->slots[j].key);
+            c->slots[i].val = lval_copy(n->slots[j].val);
+        }
+        j++;
+    }
+    return c;
+}
+
+/* Remove the slot at position pos from a copy of n, NULL if it empties */
+static lhamt* lhamt_remove(lhamt* n, int pos, uint32_t bit) {
+    if (n->count == 1) { return NULL; }
+    lhamt* c = lhamt_clone(n);
+    if (c->slots[pos].sub) {
+        lhamt_release(c->slots[pos].sub);
+    } else {
+        lval_del(c->slots[pos].key);
+        lval_del(c->slots[pos].val);
+    }
+    memmove(&c->slots[pos], &c->slots[pos+1], sizeof(lslot) * (c->count-pos-1));
+    c->count--;
+    c->bitmap &= ~bit;
+    return c;
+}
+
+lhamt* lhamt_assoc(lhamt* n, uint64_t h, lval* k, lval* v, int shift, int* added) {
+    lslot s = { h, k, v, NULL };
+
+    /* Collision nodes replace an equal key or append */
+    if (LHAMT_COLLISION(shift)) {
+        for (int i = 0; n && i < n->count; i++) {
+            if (lval_eq(n->slots[i].key, k)) {
+                lhamt* c = lhamt_clone(n);
+                lval_del(c->slots[i].val); lval_del(k);
+                c->slots[i].val = v;
+                *added = 0;
+                return c;
+            }
+        }
+        *added = 1;
+        return lhamt_insert(n, n ? n->count : 0, 0, s);
+    }
+
+    uint32_t bit = 1u << ((h >> shift) & 31);
+    int pos = n ? lhamt_popcount(n->bitmap & (bit-1)) : 0;
+
+    /* Empty position so insert the leaf here */
+    if (!n || !(n->bitmap & bit)) {
+        *added = 1;
+        return lhamt_insert(n, pos, bit, s);
+    }
+
+    lhamt* c = lhamt_clone(n);
+    lslot* old = &c->slots[pos];
+
+    if (old->sub) {
+        /* Path copy into the child */
+        lhamt* sub = lhamt_assoc(old->sub, h, k, v, shift + LHAMT_BITS, added);
+        lhamt_release(old->sub);
+        old->sub = sub;
+    } else if (old->hash == h && lval_eq(old->key, k)) {
+        /* Same key so replace the value */
+        lval_del(old->val); lval_del(k);
+        old->val = v;
+        *added = 0;
+    } else {
+        /* Different key so push both leaves down a level */
+        int ignore;
+        lhamt* sub = lhamt_assoc(NULL, old->hash, old->key, old->val,
+            shift + LHAMT_BITS, &ignore);
+        lhamt* both = lhamt_assoc(sub, h, k, v, shift + LHAMT_BITS, added);
+        lhamt_release(sub);
+        old->key = NULL;
+        old->val = NULL;
+        old->sub = both;
+    }
+
+    return c;
+}
+
+lhamt* lhamt_dissoc(lhamt* n, uint64_t h, lval* k, int shift, int* removed) {
+    *removed = 0;
+    if (!n) { return NULL; }
+
+    if (LHAMT_COLLISION(shift)) {
+        for (int i = 0; i < n->count; i++) {
+            if (lval_eq(n->slots[i].key, k)) {
+                *removed = 1;
+                return lhamt_remove(n, i, 0);
+            }
+        }
+        n->ref++;
+        return n;
+    }
+
+    uint32_t bit = 1u << ((h >> shift) & 31);
+    int pos = lhamt_popcount(n->bitmap & (bit-1));
+
+    /* Key not present so share the node unchanged */
+    if (!(n->bitmap & bit)) { n->ref++; return n; }
+
+    lslot* s = &n->slots[pos];
+    if (s->sub) {
+        lhamt* sub = lhamt_dissoc(s->sub, h, k, shift + LHAMT_BITS, removed);
+        if (!*removed) { lhamt_release(sub); n->ref++; return n; }
+        if (!sub) { return lhamt_remove(n, pos, bit); }
+        lhamt* c = lhamt_clone(n);
+        lhamt_release(c->slots[pos].sub);
+        c->slots[pos].sub = sub;
+        return c;
+    }
+
+    if (s->hash == h && lval_eq(s->key, k)) {
+        *removed = 1;
+        return lhamt_remove(n, pos, bit);
+    }
+
+    n->ref++;
+    return n;
+}
+void lhamt_keys(lhamt* n, lval* out) {
+    if (!n) { return; }
+    for (int i = 0; i < n->count; i++) {
+        if (n->slots[i].sub) {
+            lhamt_keys(n->slots[i].sub, out);
+        } else {
+            lval_add(out, lval_copy(n->slots[i].key));
+        }
+    }
+}
+uint64_t lhamt_hash(lhamt* n) {
+    uint64_t sum = 0;
+    if (!n) { return sum; }
+
+    /* Nodes never change once built so their hash is cached for good */
+    if (n->hashed) { return n->hash; }
+    for (int i = 0; i < n->count; i++) {
+        if (n->slots[i].sub) {
+            sum += lhamt_hash(n->slots[i].sub);
+        } else {
+            sum += lhash_mix(n->slots[i].hash, lval_hash(n->slots[i].val));
+        }
+    }
+    n->hash = sum;
+    n->hashed = 1;
+    return sum;
+}
+int lhamt_eq(lhamt* x, lhamt* y) {
+    /* Shared subtrees are trivially equal */
+    if (x == y || !x) { return 1; }
+    for (int i = 0; i < x->count; i++) {
+        if (x->slots[i].sub) {
+            if (!lhamt_eq(x->slots[i].sub, y)) { return 0; }
+        } else {
+            lval* v = lhamt_get(y, x->slots[i].hash, x->slots[i].key, 0);
+            if (!v || !lval_eq(x->slots[i].val, v)) { return 0; }
+        }
+    }
+    return 1;
+}
+
+/* Operations shared by both kinds of map */
+lval* lval_map_get(lval* m, lval* k) {
+    uint64_t h = lval_hash(k);
+    if (m->type == LVAL_MAP) { return lval_dict_get(m, k, h); }
+    return lhamt_get(m->root, h, k, 0);
+}
+int lval_map_eq(lval* x, lval* y) {
+    if (x->count != y->count) { return 0; }
+    if (x->type == LVAL_PMAP) { return lhamt_eq(x->root, y->root); }
+
+    /* Every entry of x must be found with an equal value in y */
+    if (x->dict == y->dict) { return 1; }
+    for (int i = 0; i < x->dict->slots; i++) {
+        for (lentry* n = x->dict->buckets[i]; n; n = n->next) {
+            lval* v = lval_dict_get(y, n->key, n->hash);
+            if (!v || !lval_eq(n->val, v)) { return 0; }
+        }
+    }
+    return 1;
+}
+void lval_map_print(lval* v) {
+    /* Print as the keys and values the map was built from */
+    lval* ks = lval_qexpr();
+    if (v->type == LVAL_MAP) {
+        for (int i = 0; i < v->dict->slots; i++) {
+            for (lentry* n = v->dict->buckets[i]; n; n = n->next) {
+                lval_add(ks, lval_copy(n->key));
+            }
+        }
+    } else {
+        lhamt_keys(v->root, ks);
+    }
+
+    printf(v->type == LVAL_MAP ? "#{" : "%%{");
+    for (int i = 0; i < ks->count; i++) {
+        lval_print(ks->cell[i]); putchar(' ');
+        lval_print(lval_map_get(v, ks->cell[i]));
+        if (i != (ks->count-1)) { putchar(' '); }
+    }
+    putchar('}');
+    lval_del(ks);
+}
+
+#define LASSERT_MAP(func, args, index) \
+    LASSERT(args, args->cell[index]->type == LVAL_MAP || \
+        args->cell[index]->type == LVAL_PMAP, \
+        "Function '%s' passed incorrect type for argument %i. " \
+        "Got %s, expected %s.", \
+        func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_MAP))
+
+/* Map builtins */
+lval* builtin_dict(lenv* e, lval* a) {
+    LASSERT(a, a->count % 2 == 0,
+        "Function 'dict' passed an odd number of arguments. "
+        "Got %i, expected pairs of keys and values.", a->count);
+
+    /* Fill the table from alternating keys and values */
+    lval* d = lval_dict();
+    for (int i = 0; i < a->count; i += 2) {
+        lval_dict_set(d, a->cell[i], a->cell[i+1]);
+    }
+
+    /* Entries now own the arguments so only free the list */
+    free(a->cell);
+    free(a);
+    return d;
+}
+lval* builtin_pdict(lenv* e, lval* a) {
+    LASSERT(a, a->count % 2 == 0,
+        "Function 'pdict' passed an odd number of arguments. "
+        "Got %i, expected pairs of keys and values.", a->count);
+
+    lval* d = lval_pdict();
+    for (int i = 0; i < a->count; i += 2) {
+        int added;
+        lval* k = a->cell[i];
+        lhamt* root = lhamt_assoc(d->root, lval_hash(k), k, a->cell[i+1], 0, &added);
+        lhamt_release(d->root);
+        d->root = root;
+        d->count += added;
+    }
+
+    free(a->cell);
+    free(a);
+    return d;
+}
+lval* builtin_get(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'get' passed incorrect number of arguments. "
+        "Got %i, expected %i or %i.", a->count, 2, 3);
+    LASSERT_MAP("get", a, 0);
+
+    /* Look up key, falling back to the default if one was given */
+    lval* v = lval_map_get(a->cell[0], a->cell[1]);
+    if (v) {
+        v = lval_copy(v);
+    } else if (a->count == 3) {
+        v = lval_pop(a, 2);
+    } else {
+        v = lval_err("Key not found in %s.", ltype_name(a->cell[0]->type));
+    }
+
+    lval_del(a);
+    return v;
+}
+static void lval_map_set(lval* m, lval* k, lval* v) {
+    /* Hash tables are updated in place, copied first if shared */
+    if (m->type == LVAL_MAP) {
+        lval_dict_set(m, k, v);
+        return;
+    }
+
+    /* Persistent maps path copy, leaving other holders untouched */
+    int added;
+    lhamt* root = lhamt_assoc(m->root, lval_hash(k), k, v, 0, &added);
+    lhamt_release(m->root);
+    m->root = root;
+    m->count += added;
+    m->hashed = 0;
+}
+static void lval_map_unset(lval* m, lval* k) {
+    if (m->type == LVAL_MAP) {
+        lval_dict_remove(m, k);
+        return;
+    }
+
+    int removed;
+    lhamt* root = lhamt_dissoc(m->root, lval_hash(k), k, 0, &removed);
+    lhamt_release(m->root);
+    m->root = root;
+    m->count -= removed;
+    m->hashed = 0;
+}
+lval* builtin_assoc(lenv* e, lval* a) {
+    LASSERT_NUM("put", a, 3);
+    LASSERT_MAP("put", a, 0);
+
+    lval* m = lval_pop(a, 0);
+    lval* k = lval_pop(a, 0);
+    lval* v = lval_pop(a, 0);
+    lval_del(a);
+    lval_map_set(m, k, v);
+    return m;
+}
+lval* builtin_dissoc(lenv* e, lval* a) {
+    LASSERT_NUM("del", a, 2);
+    LASSERT_MAP("del", a, 0);
+
+    lval* m = lval_pop(a, 0);
+    lval_map_unset(m, a->cell[0]);
+    lval_del(a);
+    return m;
+}
+
+/* (put! {m} k v) and (del! {m} k) change the map held by the variable m
+   rather than a copy of it, returning the result. The variable's own
+   copy is changed in place, so a table it holds alone is updated
+   without copying, while any other copy sharing it keeps its entries. */
+lval* builtin_map_set(lenv* e, lval* a) {
+    return builtin_map_var(e, a, "put!");
+}
+lval* builtin_map_unset(lenv* e, lval* a) {
+    return builtin_map_var(e, a, "del!");
+}
+lval* builtin_map_var(lenv* e, lval* a, char* func) {
+    int put = strcmp(func, "put!") == 0;
+    LASSERT(a, a->count == (put ? 3 : 2),
+        "Function '%s' passed incorrect number of arguments. "
+        "Got %i, expected %i.", func, a->count, put ? 3 : 2);
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+        "Function '%s' passed incorrect variable. "
+        "Got %i values, expected one symbol.", func, a->cell[0]->count);
+
+    lval* k = a->cell[0]->cell[0];
+    lval** m = lenv_slot(e, k);
+    LASSERT(a, m, "Unfound symbol '%s'", k->sym);
+    LASSERT(a, (*m)->type == LVAL_MAP || (*m)->type == LVAL_PMAP,
+        "Function '%s' passed variable '%s' of incorrect type. "
+        "Got %s, expected %s.", func, k->sym,
+        ltype_name((*m)->type), ltype_name(LVAL_MAP));
+
+    if (put) {
+        lval* x = lval_pop(a, 1);
+        lval_map_set(*m, x, lval_pop(a, 1));
+    } else {
+        lval_map_unset(*m, a->cell[1]);
+    }
+
+    /* Values held by environments keep their hash filled in */
+    lval_hash(*m);
+    lval_del(a);
+    return lval_copy(*m);
+}
+lval* builtin_keys(lenv* e, lval* a) {
+    LASSERT_NUM("keys", a, 1);
+    LASSERT_MAP("keys", a, 0);
+
+    lval* m = a->cell[0];
+    lval* ks = lval_qexpr();
+    if (m->type == LVAL_MAP) {
+        for (int i = 0; i < m->dict->slots; i++) {
+            for (lentry* n = m->dict->buckets[i]; n; n = n->next) {
+                lval_add(ks, lval_copy(n->key));
+            }
+        }
+    } else {
+        lhamt_keys(m->root, ks);
+    }
+
+    lval_del(a);
+    return ks;
+}
+lval* builtin_size(lenv* e, lval* a) {
+    LASSERT_NUM("size", a, 1);
+    LASSERT(a, a->cell[0]->type == LVAL_MAP || a->cell[0]->type == LVAL_PMAP ||
+        a->cell[0]->type == LVAL_QEXPR,
+        "Function 'size' passed incorrect type for argument 0. "
+        "Got %s, expected %s or %s.",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_MAP), ltype_name(LVAL_QEXPR));
+
+    lval* x = lval_num(a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+/* Hash-consing
+
+   When enabled the reader and the list builtins share every structurally
+   equal number, symbol, string and list through the interpreter's table. Shared
+   values are reference counted and immutable: lval_copy takes a
+   reference, lval_del drops one, and anything that modifies a value in
+   place must first call lval_thaw to get a private copy. */
+
+/* Whether canonical x is the same value as candidate y */
+static int lval_intern_eq(lval* x, lval* y) {
+    if (x->type != y->type) { return 0; }
+    switch (x->type) {
+        case LVAL_NUM: return x->num == y->num;
+        case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+        case LVAL_STR: return strcmp(x->str, y->str) == 0;
+
+        /* Elements are already canonical so compare them by address */
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (x->count != y->count) { return 0; }
+            for (int i = 0; i < x->count; i++) {
+                if (x->cell[i] != y->cell[i]) { return 0; }
+            }
+            return 1;
+    }
+    return 0;
+}
+
+lval* lval_intern(ltable* t, lval* v) {
+    if (v->interned) { return v; }
+
+    /* Only plain data can be shared */
+    switch (v->type) {
+        case LVAL_NUM: case LVAL_SYM: case LVAL_STR: break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            /* Intern bottom up so elements can be compared by address */
+            for (int i = 0; i < v->count; i++) {
+                v->cell[i] = lval_intern(t, v->cell[i]);
+                if (!v->cell[i]->interned) { return v; }
+            }
+            break;
+        default: return v;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    if (t->slots == 0) {
+        t->slots = 64;
+        t->buckets = calloc(t->slots, sizeof(lentry*));
+    }
+
+    /* Return the existing copy if there is one. An entry whose count
+       already reached zero is being freed by another thread so skip it */
+    uint64_t h = lval_hash(v);
+    for (lentry* n = t->buckets[h & (t->slots-1)]; n; n = n->next) {
+        if (n->hash == h && lval_intern_eq(n->key, v)) {
+            int ref = n->key->ref;
+            while (ref > 0 &&
+                !atomic_compare_exchange_weak(&n->key->ref, &ref, ref + 1));
+            if (ref == 0) { continue; }
+            lval* x = n->key;
+            pthread_mutex_unlock(&t->lock);
+            lval_del(v);
+            return x;
+        }
+    }
+
+    /* Otherwise this value becomes the canonical one. It can never
+       change again so its hash is kept even for numbers */
+    v->interned = t;
+    v->ref = 1;
+    v->hash = h;
+    v->hashed = 1;
+    lentry* n = malloc(sizeof(lentry));
+    n->hash = h;
+    n->key = v;
+    n->val = NULL;
+    n->next = t->buckets[h & (t->slots-1)];
+    t->buckets[h & (t->slots-1)] = n;
+    t->count++;
+
+    /* Grow the table using the same load factor as dictionaries */
+    if (t->count * 4 > t->slots * 3) {
+        int slots = t->slots * 2;
+        lentry** buckets = calloc(slots, sizeof(lentry*));
+        for (int i = 0; i < t->slots; i++) {
+            lentry* m = t->buckets[i];
+            while (m) {
+                lentry* next = m->next;
+                m->next = buckets[m->hash & (slots-1)];
+                buckets[m->hash & (slots-1)] = m;
+                m = next;
+            }
+        }
+        free(t->buckets);
+        t->buckets = buckets;
+        t->slots = slots;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+    return v;
+}
+void lval_unintern(lval* v) {
+    ltable* t = v->interned;
+    pthread_mutex_lock(&t->lock);
+    lentry** link = &t->buckets[v->hash & (t->slots-1)];
+    while (*link) {
+        if ((*link)->key == v) {
+            lentry* n = *link;
+            *link = n->next;
+            free(n);
+            t->count--;
+            break;
+        }
+        link = &(*link)->next;
+    }
+    int last = t->orphaned && t->count == 0;
+    pthread_mutex_unlock(&t->lock);
+    v->interned = NULL;
+
+    if (last) {
+        pthread_mutex_destroy(&t->lock);
+        free(t->buckets);
+        free(t);
+    }
+}
+lval* lval_hashcons(lctx* c, lval* v) {
+    return c->hashcons ? lval_intern(&c->interned, v) : v;
+}
+lval* lval_thaw(lval* v) {
+    if (!v->interned) { return v; }
+
+    /* Build a private copy, elements stay shared until they are thawed.
+       The copy exists to be changed, so it doesn't keep the cached hash */
+    lval* x = malloc(sizeof(lval));
+    x->type = v->type;
+    x->hashed = 0;
+    x->interned = NULL;
+    switch (v->type) {
+        case LVAL_NUM: x->num = v->num; break;
+        case LVAL_SYM:
+            x->sym = malloc(strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
+            break;
+        case LVAL_STR:
+            x->str = malloc(strlen(v->str) + 1);
+            strcpy(x->str, v->str);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->count = v->count;
+            x->cell = malloc(sizeof(lval*) * x->count);
+            for (int i = 0; i < x->count; i++) {
+                x->cell[i] = lval_copy(v->cell[i]);
+            }
+            break;
+    }
+
+    lval_del(v);
+    return x;
+}
+lval* builtin_hashcons(lenv* e, lval* a) {
+    LASSERT_NUM("hashcons", a, 1);
+    LASSERT_TYPE("hashcons", a, 0, LVAL_NUM);
+
+    /* Switch mode and return the previous setting */
+    lval* x = lval_num(e->ctx->hashcons);
+    e->ctx->hashcons = a->cell[0]->num != 0;
+    lval_del(a);
+    return x;
+}
+
+/* Memoization
+
+   A memoized function keeps a cache from argument lists to results,
+   keyed by structural hash and lval_eq. Entries are chained per bucket
+   for lookup and kept in a doubly linked list from newest to oldest use
+   so the least recently used entry is evicted once the limit is hit. */
+lmemo* lmemo_new(lval* fun, int limit) {
+    lmemo* m = malloc(sizeof(lmemo));
+    m->ref = 1;
+    m->fun = fun;
+    m->limit = limit;
+    m->count = 0;
+    m->slots = 16;
+    m->buckets = calloc(m->slots, sizeof(lmemo_entry*));
+    m->newest = NULL;
+    m->oldest = NULL;
+    m->hits = 0;
+    m->misses = 0;
+    pthread_mutex_init(&m->lock, NULL);
+    return m;
+}
+void lmemo_release(lmemo* m) {
+    if (--m->ref > 0) { return; }
+    lmemo_entry* n = m->newest;
+    while (n) {
+        lmemo_entry* older = n->older;
+        lval_del(n->args); lval_del(n->result); free(n);
+        n = older;
+    }
+    lval_del(m->fun);
+    free(m->buckets);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+/* Unlink an entry from the use order */
+static void lmemo_unlink(lmemo* m, lmemo_entry* n) {
+    if (n->newer) { n->newer->older = n->older; } else { m->newest = n->older; }
+    if (n->older) { n->older->newer = n->newer; } else { m->oldest = n->newer; }
+}
+
+/* Link an entry in as the most recently used */
+static void lmemo_touch(lmemo* m, lmemo_entry* n) {
+    n->newer = NULL;
+    n->older = m->newest;
+    if (m->newest) { m->newest->newer = n; }
+    m->newest = n;
+    if (!m->oldest) { m->oldest = n; }
+}
+
+static void lmemo_evict(lmemo* m) {
+    lmemo_entry* n = m->oldest;
+    lmemo_unlink(m, n);
+
+    /* Remove from its bucket chain */
+    lmemo_entry** link = &m->buckets[n->hash & (m->slots-1)];
+    while (*link != n) { link = &(*link)->next; }
+    *link = n->next;
+
+    lval_del(n->args); lval_del(n->result); free(n);
+    m->count--;
+}
+
+static void lmemo_grow(lmemo* m) {
+    int slots = m->slots * 2;
+    lmemo_entry** buckets = calloc(slots, sizeof(lmemo_entry*));
+    for (lmemo_entry* n = m->newest; n; n = n->older) {
+        n->next = buckets[n->hash & (slots-1)];
+        buckets[n->hash & (slots-1)] = n;
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->slots = slots;
+}
+
+lval* lmemo_call(lenv* e, lmemo* m, lval* a) {
+    uint64_t h = lval_hash(a);
+
+    /* On a hit move the entry to the front and return a copy */
+    pthread_mutex_lock(&m->lock);
+    for (lmemo_entry* n = m->buckets[h & (m->slots-1)]; n; n = n->next) {
+        if (n->hash == h && lval_eq(n->args, a)) {
+            m->hits++;
+            lmemo_unlink(m, n);
+            lmemo_touch(m, n);
+            lval* r = lval_copy(n->result);
+            pthread_mutex_unlock(&m->lock);
+            lval_del(a);
+            return r;
+        }
+    }
+
+    /* On a miss call a copy of the function, as calls consume formals.
+       The lock is not held during the call as it may recurse */
+    m->misses++;
+    pthread_mutex_unlock(&m->lock);
+    lval* args = lval_copy(a);
+    lval* f = lval_copy(m->fun);
+    lval* r = lval_call(e, f, a);
+    lval_del(f);
+
+    /* Errors are not cached as they may come from the environment */
+    if (r->type == LVAL_ERR || m->limit == 0) {
+        lval_del(args);
+        return r;
+    }
+
+    /* The recursive call may have cached these arguments already */
+    pthread_mutex_lock(&m->lock);
+    for (lmemo_entry* n = m->buckets[h & (m->slots-1)]; n; n = n->next) {
+        if (n->hash == h && lval_eq(n->args, args)) {
+            pthread_mutex_unlock(&m->lock);
+            lval_del(args);
+            return r;
+        }
+    }
+
+    if (m->count >= m->limit) { lmemo_evict(m); }
+
+    lmemo_entry* n = malloc(sizeof(lmemo_entry));
+    n->hash = h;
+    n->args = args;
+    n->result = lval_copy(r);
+    n->next = m->buckets[h & (m->slots-1)];
+    m->buckets[h & (m->slots-1)] = n;
+    lmemo_touch(m, n);
+    m->count++;
+
+    if (m->count * 4 > m->slots * 3) { lmemo_grow(m); }
+    pthread_mutex_unlock(&m->lock);
+    return r;
+}
+
+lval* builtin_memo(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1 || a->count == 2,
+        "Function 'memo' passed incorrect number of arguments. "
+        "Got %i, expected %i or %i.", a->count, 1, 2);
+    LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+
+    /* Optional second argument bounds the number of cached results */
+    int limit = 4096;
+    if (a->count == 2) {
+        LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+        LASSERT(a, a->cell[1]->num >= 0,
+            "Function 'memo' passed negative cache size %li.", a->cell[1]->num);
+        limit = a->cell[1]->num;
+    }
+
+    lval* v = lval_fun(NULL);
+    v->memo = lmemo_new(lval_pop(a, 0), limit);
+    lval_del(a);
+    return v;
+}
+lval* builtin_memo_stats(lenv* e, lval* a) {
+    LASSERT_NUM("memo-stats", a, 1);
+    LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+    LASSERT(a, a->cell[0]->memo != NULL,
+        "Function 'memo-stats' passed a function that is not memoized.");
+
+    /* Return {hits misses size limit} */
+    lmemo* m = a->cell[0]->memo;
+    lval* x = lval_qexpr();
+    pthread_mutex_lock(&m->lock);
+    lval_add(x, lval_num(m->hits));
+    lval_add(x, lval_num(m->misses));
+    lval_add(x, lval_num(m->count));
+    lval_add(x, lval_num(m->limit));
+    pthread_mutex_unlock(&m->lock);
+    lval_del(a);
+    return x;
+}
+
+/* Lazy sequences
+
+   A sequence is an immutable description of how to produce elements,
+   shared between copies. Nothing is computed until a cursor is opened
+   over it and pulled one element at a time, so pipelines only ever hold
+   the element currently passing through each stage. */
+lseq* lseq_new(int kind) {
+    lseq* s = malloc(sizeof(lseq));
+    s->ref = 1;
+    s->kind = kind;
+    s->start = 0; s->end = 0; s->step = 1;
+    s->fn = NULL;
+    s->seed = NULL;
+    s->src = NULL;
+    s->env = NULL;
+    return s;
+}
+void lseq_release(lseq* s) {
+    if (!s || --s->ref > 0) { return; }
+    if (s->fn) { lval_del(s->fn); }
+    if (s->seed) { lval_del(s->seed); }
+    if (s->env) { lenv_del(s->env); }
+    lseq_release(s->src);
+    free(s);
+}
+lval* lval_seq(lseq* s) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_SEQ;
+    v->hashed = 0;
+    v->interned = NULL;
+    v->seq = s;
+    return v;
+}
+
+/* Turn a sequence or Q-Expression argument into a shared description */
+lseq* lseq_from(lval* v) {
+    if (v->type == LVAL_SEQ) {
+        v->seq->ref++;
+        return v->seq;
+    }
+    lseq* s = lseq_new(LSEQ_LIST);
+    s->seed = lval_copy(v);
+    return s;
+}
+
+lcursor* lcursor_new(lseq* s) {
+    lcursor* c = malloc(sizeof(lcursor));
+    c->seq = s;
+    c->i = 0;
+    c->cur = NULL;
+    c->src = s->src ? lcursor_new(s->src) : NULL;
+    c->gen = s->kind == LSEQ_GEN ? lgen_new(s) : NULL;
+    return c;
+}
+void lcursor_del(lcursor* c) {
+    if (!c) { return; }
+    if (c->cur) { lval_del(c->cur); }
+    lcursor_del(c->src);
+    if (c->gen) { lgen_del(c->gen); }
+    free(c);
+}
+
+/* Call f with a single argument */
+lval* lval_apply1(lenv* e, lval* f, lval* x) {
+    lval* fc = lval_copy(f);
+    lval* r = lval_call(e, fc, lval_add(lval_sexpr(), x));
+    lval_del(fc);
+    return r;
+}
+
+/* Produce the next element, or NULL once the sequence is exhausted */
+lval* lcursor_next(lenv* e, lcursor* c) {
+    lseq* s = c->seq;
+    switch (s->kind) {
+        case LSEQ_RANGE: {
+            long x = s->start + c->i * s->step;
+            if (s->step > 0 ? x >= s->end : x <= s->end) { return NULL; }
+            c->i++;
+            return lval_num(x);
+        }
+
+        case LSEQ_LIST:
+            if (c->i >= s->seed->count) { return NULL; }
+            return lval_copy(s->seed->cell[c->i++]);
+
+        case LSEQ_ITERATE: {
+            /* Yield the seed first, then keep applying the function */
+            lval* next = c->cur ? lval_apply1(e, s->fn, lval_copy(c->cur))
+                                : lval_copy(s->seed);
+            if (c->cur) { lval_del(c->cur); }
+            c->cur = lval_copy(next);
+            return next;
+        }
+
+        case LSEQ_MAP: {
+            lval* x = lcursor_next(e, c->src);
+            if (!x || x->type == LVAL_ERR) { return x; }
+            return lval_apply1(e, s->fn, x);
+        }
+
+        case LSEQ_FILTER:
+            for (;;) {
+                lval* x = lcursor_next(e, c->src);
+                if (!x || x->type == LVAL_ERR) { return x; }
+                lval* keep = lval_apply1(e, s->fn, lval_copy(x));
+                if (keep->type == LVAL_ERR) { lval_del(x); return keep; }
+                int ok = keep->type == LVAL_NUM && keep->num;
+                lval_del(keep);
+                if (ok) { return x; }
+                lval_del(x);
+            }
+
+        case LSEQ_TAKE:
+            if (c->i >= s->end) { return NULL; }
+            c->i++;
+            return lcursor_next(e, c->src);
+
+        case LSEQ_GEN:
+            return lgen_next(c->gen);
+    }
+    return NULL;
+}
+
+#define LASSERT_SEQ(func, args, index) \
+    LASSERT(args, args->cell[index]->type == LVAL_SEQ || \
+        args->cell[index]->type == LVAL_QEXPR, \
+        "Function '%s' passed incorrect type for argument %i. " \
+        "Got %s, expected %s.", \
+        func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_SEQ))
+
+lval* builtin_range(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1 && a->count <= 3,
+        "Function 'range' passed incorrect number of arguments. "
+        "Got %i, expected between %i and %i.", a->count, 1, 3);
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("range", a, i, LVAL_NUM);
+    }
+
+    /* (range end), (range start end) or (range start end step) */
+    lseq* s = lseq_new(LSEQ_RANGE);
+    if (a->count == 1) {
+        s->end = a->cell[0]->num;
+    } else {
+        s->start = a->cell[0]->num;
+        s->end = a->cell[1]->num;
+    }
+    if (a->count == 3) {
+        if (a->cell[2]->num == 0) {
+            lseq_release(s);
+            lval_del(a);
+            return lval_err("Function 'range' passed a step of 0.");
+        }
+        s->step = a->cell[2]->num;
+    }
+
+    lval_del(a);
+    return lval_seq(s);
+}
+lval* builtin_iterate(lenv* e, lval* a) {
+    LASSERT_NUM("iterate", a, 2);
+    LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+
+    lseq* s = lseq_new(LSEQ_ITERATE);
+    s->fn = lval_pop(a, 0);
+    s->seed = lval_pop(a, 0);
+    lval_del(a);
+    return lval_seq(s);
+}
+lval* builtin_map(lenv* e, lval* a) {
+    LASSERT_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_SEQ("map", a, 1);
+
+    lseq* s = lseq_new(LSEQ_MAP);
+    s->src = lseq_from(a->cell[1]);
+    s->fn = lval_pop(a, 0);
+    lval_del(a);
+    return lval_seq(s);
+}
+lval* builtin_filter(lenv* e, lval* a) {
+    LASSERT_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_SEQ("filter", a, 1);
+
+    lseq* s = lseq_new(LSEQ_FILTER);
+    s->src = lseq_from(a->cell[1]);
+    s->fn = lval_pop(a, 0);
+    lval_del(a);
+    return lval_seq(s);
+}
+lval* builtin_take(lenv* e, lval* a) {
+    LASSERT_NUM("take", a, 2);
+    LASSERT_TYPE("take", a, 0, LVAL_NUM);
+    LASSERT_SEQ("take", a, 1);
+
+    lseq* s = lseq_new(LSEQ_TAKE);
+    s->end = a->cell[0]->num;
+    s->src = lseq_from(a->cell[1]);
+    lval_del(a);
+    return lval_seq(s);
+}
+lval* builtin_fold(lenv* e, lval* a) {
+    LASSERT_NUM("fold", a, 3);
+    LASSERT_TYPE("fold", a, 0, LVAL_FUN);
+    LASSERT_SEQ("fold", a, 2);
+
+    /* Pull elements one at a time, calling (f acc x) for each */
+    lval* f = a->cell[0];
+    lval* acc = lval_copy(a->cell[1]);
+    lseq* s = lseq_from(a->cell[2]);
+    lcursor* c = lcursor_new(s);
+
+    lval* x;
+    while ((x = lcursor_next(e, c))) {
+        if (x->type == LVAL_ERR) { lval_del(acc); acc = x; break; }
+        lval* fc = lval_copy(f);
+        acc = lval_call(e, fc, lval_add(lval_add(lval_sexpr(), acc), x));
+        lval_del(fc);
+        if (acc->type == LVAL_ERR) { break; }
+    }
+
+    lcursor_del(c);
+    lseq_release(s);
+    lval_del(a);
+    return acc;
+}
+lval* builtin_collect(lenv* e, lval* a) {
+    LASSERT_NUM("collect", a, 1);
+    LASSERT_SEQ("collect", a, 0);
+
+    /* Materialize a finite sequence into a Q-Expression */
+    lseq* s = lseq_from(a->cell[0]);
+    lcursor* c = lcursor_new(s);
+    lval* q = lval_qexpr();
+
+    lval* x;
+    while ((x = lcursor_next(e, c))) {
+        if (x->type == LVAL_ERR) { lval_del(q); q = x; break; }
+        lval_add(q, x);
+    }
+
+    lcursor_del(c);
+    lseq_release(s);
+    lval_del(a);
+    return q;
+}
+
+/* Chase-Lev work stealing deque. Only the owning worker pushes and takes
+   at the bottom, any thread may steal from the top. */
+static int ldeque_push(ldeque* d, ltask* t) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - top >= LDEQUE_SIZE) { return 0; }
+    atomic_store_explicit(&d->buf[b % LDEQUE_SIZE], t, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+static ltask* ldeque_take(ldeque* d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    ltask* t = NULL;
+    if (top <= b) {
+        t = atomic_load_explicit(&d->buf[b % LDEQUE_SIZE], memory_order_relaxed);
+        if (top == b) {
+            /* Last task, race any thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                t = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return t;
+}
+static ltask* ldeque_steal(ldeque* d) {
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= b) { return NULL; }
+
+    ltask* t = atomic_load_explicit(&d->buf[top % LDEQUE_SIZE], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return t;
+}
+
+/* Which pool and deque the current thread works for, if any */
+static _Thread_local lpool* lpool_self = NULL;
+static _Thread_local int lpool_id = -1;
+
+typedef struct { lpool* pool; int id; } lworker;
+
+static void* lpool_worker(void* arg) {
+    lworker* w = arg;
+    lpool* p = w->pool;
+    lpool_self = p;
+    lpool_id = w->id;
+    free(w);
+
+    for (;;) {
+        ltask* t = lpool_find(p);
+        if (t) { t->run(t); continue; }
+
+        /* Nothing to do so sleep until work is submitted */
+        pthread_mutex_lock(&p->lock);
+        while (!p->quit && p->pending == 0) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        int quit = p->quit;
+        pthread_mutex_unlock(&p->lock);
+        if (quit) { break; }
+    }
+    return NULL;
+}
+
+lpool* lpool_new(int count) {
+    lpool* p = malloc(sizeof(lpool));
+    p->count = count;
+    p->inject = NULL;
+    p->pending = 0;
+    p->quit = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    p->deques = malloc(sizeof(ldeque) * count);
+    for (int i = 0; i < count; i++) {
+        atomic_init(&p->deques[i].top, 0);
+        atomic_init(&p->deques[i].bottom, 0);
+    }
+
+    p->threads = malloc(sizeof(pthread_t) * count);
+    for (int i = 0; i < count; i++) {
+        lworker* w = malloc(sizeof(lworker));
+        w->pool = p;
+        w->id = i;
+        pthread_create(&p->threads[i], NULL, lpool_worker, w);
+    }
+    return p;
+}
+void lpool_del(lpool* p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->count; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    free(p->threads);
+    free(p->deques);
+    free(p);
+}
+lpool* lctx_pool(lctx* c) {
+    /* One worker per online processor */
+    pthread_mutex_lock(&c->lock);
+    if (!c->pool) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        c->pool = lpool_new(n > 0 ? n : 1);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return c->pool;
+}
+void lpool_submit(lpool* p, ltask* t) {
+    p->pending++;
+
+    /* Workers push onto their own deque, everyone else injects */
+    if (lpool_self != p || !ldeque_push(&p->deques[lpool_id], t)) {
+        pthread_mutex_lock(&p->lock);
+        t->next = p->inject;
+        p->inject = t;
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+ltask* lpool_find(lpool* p) {
+    ltask* t = NULL;
+
+    /* Own deque first, newest task as it is the most likely to be cached */
+    if (lpool_self == p) { t = ldeque_take(&p->deques[lpool_id]); }
+
+    /* Then anything injected from outside */
+    if (!t && p->inject) {
+        pthread_mutex_lock(&p->lock);
+        t = p->inject;
+        if (t) { p->inject = t->next; }
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    /* Then steal the oldest task of another worker */
+    int start = lpool_id < 0 ? 0 : lpool_id + 1;
+    for (int i = 0; !t && i < p->count; i++) {
+        int victim = (start + i) % p->count;
+        if (lpool_self == p && victim == lpool_id) { continue; }
+        t = ldeque_steal(&p->deques[victim]);
+    }
+
+    if (t) { p->pending--; }
+    return t;
+}
+void lpool_wait(lpool* p, atomic_long* remaining) {
+    while (*remaining > 0) {
+        /* Help with outstanding work rather than just blocking */
+        ltask* t = lpool_find(p);
+        if (t) { t->run(t); continue; }
+
+        /* Workers must never block or nested jobs could deadlock */
+        if (lpool_self == p) { sched_yield(); continue; }
+
+        pthread_mutex_lock(&p->lock);
+        while (*remaining > 0 && p->pending == 0) {
+            pthread_cond_wait(&p->done, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+void lpool_finish(lpool* p, atomic_long* remaining, long n) {
+    /* The waiter may free the job as soon as this reaches zero */
+    if (atomic_fetch_sub(remaining, n) == n) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->done);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* Call f with a copy of its arguments, as calls consume a lambda's formals */
+static lval* lpjob_call(lpjob* j, lval* args) {
+    lval* f = lval_copy(j->f);
+    lval* r = lval_call(j->e, f, args);
+    lval_del(f);
+    return r;
+}
+
+static void lpjob_run(ltask* t) {
+    lpjob* j = t->job;
+
+    /* Keep splitting off the upper half for thieves while it is large */
+    while (t->hi - t->lo > j->grain) {
+        long mid = t->lo + (t->hi - t->lo) / 2;
+        ltask* right = malloc(sizeof(ltask));
+        right->run = lpjob_run;
+        right->job = j;
+        right->lo = mid;
+        right->hi = t->hi;
+        lpool_submit(j->pool, right);
+        t->hi = mid;
+    }
+
+    if (j->reduce) {
+        /* Fold the chunk left to right, storing the result at its start */
+        lval* acc = lval_copy(j->in[t->lo]);
+        for (long i = t->lo + 1; i < t->hi && acc->type != LVAL_ERR; i++) {
+            lval* args = lval_add(lval_add(lval_sexpr(), acc), lval_copy(j->in[i]));
+            acc = lpjob_call(j, args);
+        }
+        j->out[t->lo] = acc;
+        j->ends[t->lo] = t->hi;
+    } else {
+        for (long i = t->lo; i < t->hi; i++) {
+            j->out[i] = lpjob_call(j, lval_add(lval_sexpr(), lval_copy(j->in[i])));
+        }
+    }
+
+    lpool* p = j->pool;
+    long n = t->hi - t->lo;
+    free(t);
+    lpool_finish(p, &j->remaining, n);
+}
+
+lval* lval_parallel(lenv* e, lval* a, int reduce) {
+    char* func = reduce ? "preduce" : "pmap";
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+
+    lval* list = a->cell[1];
+    long n = list->count;
+    if (n == 0) {
+        lval_del(a);
+        return reduce ? lval_err("Function 'preduce' passed {}.") : lval_qexpr();
+    }
+
+    lpool* p = lctx_pool(e->ctx);
+
+    lpjob j;
+    j.pool = p;
+    j.e = e;
+    j.f = a->cell[0];
+    j.in = list->cell;
+    j.out = malloc(sizeof(lval*) * n);
+    j.ends = reduce ? malloc(sizeof(long) * n) : NULL;
+    j.reduce = reduce;
+    atomic_init(&j.remaining, n);
+
+    /* Aim for several chunks per worker so stealing can balance load */
+    j.grain = n / (p->count * 8);
+    if (j.grain < 1) { j.grain = 1; }
+
+    ltask* t = malloc(sizeof(ltask));
+    t->run = lpjob_run;
+    t->job = &j;
+    t->lo = 0;
+    t->hi = n;
+    lpool_submit(p, t);
+    lpool_wait(p, &j.remaining);
+
+    lval* x;
+    if (reduce) {
+        /* Combine the chunk results in order */
+        x = j.out[0];
+        for (long i = j.ends[0]; i < n; i = j.ends[i]) {
+            if (x->type == LVAL_ERR) { lval_del(j.out[i]); continue; }
+            x = lpjob_call(&j, lval_add(lval_add(lval_sexpr(), x), j.out[i]));
+        }
+        free(j.ends);
+    } else {
+        /* Results are already in order, return the first error if any */
+        x = lval_qexpr();
+        for (long i = 0; i < n; i++) {
+            if (x->type == LVAL_ERR) { lval_del(j.out[i]); continue; }
+            if (j.out[i]->type == LVAL_ERR) { lval_del(x); x = j.out[i]; continue; }
+            lval_add(x, j.out[i]);
+        }
+    }
+
+    free(j.out);
+    lval_del(a);
+    return x;
+}
+lval* builtin_pmap(lenv* e, lval* a) {
+    return lval_parallel(e, a, 0);
+}
+lval* builtin_preduce(lenv* e, lval* a) {
+    return lval_parallel(e, a, 1);
+}
+
+/* Futures
+
+   A future evaluates a Q-Expression on a pool worker. The calling frames
+   may be gone before the worker runs, so the expression is evaluated in
+   a snapshot of every binding visible where it was created. The global
+   environment is copied too, since the main thread may def into it while
+   the worker reads it, so later defs on either side aren't seen by the
+   other. The result is handed back once remaining reaches zero.
+
+   Green threads and generators run on the thread that made them, so
+   their snapshots stop at the global environment and keep it live. */
+lenv* lenv_snapshot(lenv* e, int globals) {
+    lenv* n = lenv_new();
+    n->ctx = e->ctx;
+
+    /* Copy frames innermost first so inner bindings shadow outer ones.
+       Names are unique within a frame, so only earlier frames can shadow
+       and the copies are appended without lenv_put's search. */
+    for (; e; e = e->par) {
+        if (!e->par && !globals) { break; }
+        int inner = n->count;
+        n->syms = realloc(n->syms, sizeof(char*) * (inner + e->count));
+        n->vals = realloc(n->vals, sizeof(lval*) * (inner + e->count));
+        for (int i = 0; i < e->count; i++) {
+            int shadowed = 0;
+            for (int j = 0; j < inner; j++) {
+                if (strcmp(n->syms[j], e->syms[i]) == 0) { shadowed = 1; break; }
+            }
+            if (shadowed) { continue; }
+            n->syms[n->count] = malloc(strlen(e->syms[i]) + 1);
+            strcpy(n->syms[n->count], e->syms[i]);
+            n->vals[n->count] = lval_copy(e->vals[i]);
+            lval_hash(n->vals[n->count]);
+            n->count++;
+        }
+    }
+
+    /* With the globals copied nothing links back to the caller's thread */
+    n->par = e;
+    return n;
+}
+lval* lval_future(lfuture* f) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_FUTURE;
+    v->hashed = 0;
+    v->interned = NULL;
+    v->fut = f;
+    return v;
+}
+void lfuture_release(lfuture* f) {
+    if (atomic_fetch_sub(&f->ref, 1) > 1) { return; }
+    if (f->expr) { lval_del(f->expr); }
+    if (f->result) { lval_del(f->result); }
+    lenv_del(f->env);
+    free(f);
+}
+static void lfuture_run(ltask* t) {
+    lfuture* f = t->job;
+    free(t);
+
+    lval* x = f->expr;
+    f->expr = NULL;
+    x->type = LVAL_SEXPR;
+    f->result = lval_eval(f->env, x);
+
+    /* Publish the result and drop the reference the task held */
+    lpool_finish(f->env->ctx->pool, &f->remaining, 1);
+    lfuture_release(f);
+}
+lval* builtin_future(lenv* e, lval* a) {
+    LASSERT_NUM("future", a, 1);
+    LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+    lfuture* f = malloc(sizeof(lfuture));
+    atomic_init(&f->ref, 2);
+    atomic_init(&f->remaining, 1);
+    f->env = lenv_snapshot(e, 1);
+    f->expr = lval_thaw(lval_take(a, 0));
+    f->result = NULL;
+    f->green = 0;
+    f->waiters = NULL;
+
+    ltask* t = malloc(sizeof(ltask));
+    t->run = lfuture_run;
+    t->job = f;
+    lpool_submit(lctx_pool(e->ctx), t);
+
+    return lval_future(f);
+}
+lval* builtin_await(lenv* e, lval* a) {
+    LASSERT_NUM("await", a, 1);
+    LASSERT_TYPE("await", a, 0, LVAL_FUTURE);
+
+    /* Green threads wake their awaiters when they finish */
+    lfuture* f = a->cell[0]->fut;
+    if (f->green && f->remaining > 0) {
+        LASSERT(a, lsched_await(e->ctx, f),
+            "Function 'await' would wait forever, no green thread can run.");
+    }
+
+    /* Pool workers can't wake this thread, so keep the green threads
+       going and help the pool in between in case it has no workers */
+    lpool* p = e->ctx->pool;
+    while (f->remaining > 0 && lsched_yield(e->ctx)) {
+        ltask* t = p ? lpool_find(p) : NULL;
+        if (t) { t->run(t); }
+    }
+
+    /* Run other pending work while waiting for this result */
+    if (f->remaining > 0) { lpool_wait(lctx_pool(e->ctx), &f->remaining); }
+
+    lval* x = lval_copy(f->result);
+    lval_del(a);
+    return x;
+}
+
+/* Bounded rings
+
+   A multi-producer multi-consumer queue after Vyukov. A cell whose seq
+   equals a sender's position is free for it, one whose seq is one past
+   a receiver's position holds a value for it. Positions are claimed with
+   a CAS on head or tail, and the cell is then handed over by storing the
+   seq the other side waits for. Positions are masked into the cells, so
+   there is a power of two of them. A sender first reserves one of limit
+   places in count, so a ring holds exactly as many values as asked. */
+void lring_init(lring* r, long limit) {
+    /* With one cell a freed slot's seq would equal the one marking it
+       full, so every ring has at least two */
+    long cap = 2;
+    while (cap < limit) { cap *= 2; }
+    r->cells = malloc(sizeof(lcell) * cap);
+    for (long i = 0; i < cap; i++) { atomic_init(&r->cells[i].seq, i); }
+    r->mask = cap - 1;
+    r->limit = limit;
+    atomic_init(&r->count, 0);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+}
+void lring_free(lring* r) {
+    lval* v;
+    while ((v = lring_pop(r))) { lval_del(v); }
+    free(r->cells);
+}
+int lring_push(lring* r, lval* v, size_t* at) {
+    long n = atomic_load(&r->count);
+    do {
+        if (n >= r->limit) { return 0; }
+    } while (!atomic_compare_exchange_weak(&r->count, &n, n + 1));
+
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    lcell* c;
+    for (;;) {
+        c = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+        /* Free cell, claim it by moving head past it */
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) { break; }
+        } else if (dif < 0) {
+            /* A receiver has not freed this cell yet so the ring is full */
+            atomic_fetch_sub(&r->count, 1);
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+
+    c->msg = v;
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    if (at) { *at = pos; }
+    return 1;
+}
+lval* lring_pop(lring* r) {
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    lcell* c;
+    for (;;) {
+        c = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        /* Filled cell, claim it by moving tail past it */
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) { break; }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+
+    /* Hand the cell back to senders one lap ahead */
+    lval* v = c->msg;
+    atomic_store_explicit(&c->seq, pos + r->mask + 1, memory_order_release);
+    atomic_fetch_sub(&r->count, 1);
+    return v;
+}
+
+/* Actors
+
+   An actor owns a state value, a handler and an environment of its own.
+   The environment snapshots every binding visible where the actor was
+   made, globals included, so a handler never reads another thread's
+   environment while it changes. Each message is handled by calling
+   (handler state msg) and the result becomes the new state. Messages
+   are copies, so the only thing actors share is the lock-free mailbox.
+   An actor is scheduled onto the worker pool when a message arrives and
+   it is not already running. */
+lval* lval_actor(lactor* a) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_ACTOR;
+    v->hashed = 0;
+    v->interned = NULL;
+    v->actor = a;
+    return v;
+}
+void lactor_release(lactor* a) {
+    if (atomic_fetch_sub(&a->ref, 1) > 1) { return; }
+
+    /* Also drops any messages that were never handled */
+    lring_free(&a->box);
+    lval_del(a->handler);
+    lval_del(a->state);
+    lenv_del(a->env);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+}
+int lactor_send(lactor* a, lval* msg) {
+    /* Count the message before it becomes visible to the receiver */
+    a->pending++;
+    if (!lring_push(&a->box, msg, NULL)) {
+        a->pending--;
+        return 0;
+    }
+    lactor_schedule(a);
+    return 1;
+}
+
+/* Handle a batch of messages, then give other actors a turn */
+static void lactor_run(ltask* t) {
+    lactor* a = t->job;
+    free(t);
+
+    lval* msg;
+    for (int i = 0; i < 64 && (msg = lring_pop(&a->box)); i++) {
+        lval* f = lval_copy(a->handler);
+        lval* args = lval_add(lval_add(lval_sexpr(), lval_copy(a->state)), msg);
+        lval* r = lval_call(a->env, f, args);
+        lval_del(f);
+
+        /* Errors are reported and leave the state as it was */
+        if (r->type == LVAL_ERR) {
+            lval_println(r);
+            lval_del(r);
+        } else {
+            pthread_mutex_lock(&a->lock);
+            lval* old = a->state;
+            a->state = r;
+            pthread_mutex_unlock(&a->lock);
+            lval_del(old);
+        }
+
+        lpool_finish(a->pool, &a->pending, 1);
+    }
+
+    /* Unschedule, then check for messages that raced with that */
+    a->scheduled = 0;
+    if (a->pending > 0) { lactor_schedule(a); }
+    lactor_release(a);
+}
+void lactor_schedule(lactor* a) {
+    if (atomic_exchange(&a->scheduled, 1)) { return; }
+    a->ref++;
+    ltask* t = malloc(sizeof(ltask));
+    t->run = lactor_run;
+    t->job = a;
+    lpool_submit(a->pool, t);
+}
+
+lval* builtin_actor(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'actor' passed incorrect number of arguments. "
+        "Got %i, expected %i or %i.", a->count, 2, 3);
+    LASSERT_TYPE("actor", a, 0, LVAL_FUN);
+
+    long cap = 1024;
+    if (a->count == 3) {
+        LASSERT_TYPE("actor", a, 2, LVAL_NUM);
+        LASSERT(a, a->cell[2]->num > 0,
+            "Function 'actor' passed mailbox size %li, expected at least 1.",
+            a->cell[2]->num);
+        cap = a->cell[2]->num;
+    }
+
+    lactor* x = malloc(sizeof(lactor));
+    atomic_init(&x->ref, 1);
+    x->env = lenv_snapshot(e, 1);
+    x->handler = lval_pop(a, 0);
+    x->state = lval_pop(a, 0);
+    pthread_mutex_init(&x->lock, NULL);
+
+    lring_init(&x->box, cap);
+
+    atomic_init(&x->pending, 0);
+    atomic_init(&x->scheduled, 0);
+    x->pool = lctx_pool(e->ctx);
+
+    lval_del(a);
+    return lval_actor(x);
+}
+lval* builtin_send(lenv* e, lval* a) {
+    if (a->count == 2 && a->cell[0]->type == LVAL_CHAN) {
+        return builtin_chan_send(e, a);
+    }
+    LASSERT_NUM("send", a, 2);
+    LASSERT_TYPE("send", a, 0, LVAL_ACTOR);
+
+    /* Returns 0 without sending if the mailbox is full */
+    lval* msg = lval_pop(a, 1);
+    int sent = lactor_send(a->cell[0]->actor, msg);
+    if (!sent) { lval_del(msg); }
+
+    lval_del(a);
+    return lval_num(sent);
+}
+lval* builtin_state(lenv* e, lval* a) {
+    LASSERT_NUM("state", a, 1);
+    LASSERT_TYPE("state", a, 0, LVAL_ACTOR);
+
+    /* Wait for the mailbox to drain, then copy the state out */
+    lactor* x = a->cell[0]->actor;
+    lpool_wait(x->pool, &x->pending);
+
+    pthread_mutex_lock(&x->lock);
+    lval* v = lval_copy(x->state);
+    pthread_mutex_unlock(&x->lock);
+
+    lval_del(a);
+    return v;
+}
+
+/* Green Threads
+
+   Green threads are coroutines with stacks of their own, switched with
+   swapcontext. Scheduling is cooperative: a thread runs until it yields,
+   sleeps or awaits, then the next one in the run queue takes over.
+   Sleepers are kept sorted by wake time, and when nothing else can run
+   the scheduler sleeps until the first of them is due. */
+static long lnow_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+static void lsleep_ms(long ms) {
+    if (ms <= 0) { return; }
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) == -1) {}
+}
+/* Generator running on this thread, if any. Saved across green thread
+   switches since another green thread may be inside a different one. */
+static _Thread_local lgen* lgen_self = NULL;
+
+/* Lowest address evaluation may reach on the stack running now, or NULL
+   on a thread's own stack. Saved and restored like lgen_self. */
+static _Thread_local char* lstack_floor = NULL;
+
+/* Coroutine stacks. The lowest page is a guard so that an overflow
+   faults instead of corrupting whatever is mapped below. Nothing is
+   reserved up front, so only the pages a body touches cost memory. */
+char* lstack_new(size_t* size) {
+    long page = sysconf(_SC_PAGESIZE);
+    *size = LGREEN_STACK + page;
+    char* stack = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) { return NULL; }
+    mprotect(stack, page, PROT_NONE);
+    return stack;
+}
+void lstack_del(char* stack, size_t size) {
+    munmap(stack, size);
+}
+static char* lstack_limit(char* stack, size_t size) {
+    return stack + size - LGREEN_STACK + LSTACK_SLACK;
+}
+int lstack_exhausted(void) {
+    char here;
+    return lstack_floor && &here < lstack_floor;
+}
+
+static int lsched_owned(lsched* s) {
+    return pthread_equal(s->owner, pthread_self());
+}
+static void lsched_push(lsched* s, lgreen* g) {
+    g->next = NULL;
+    if (s->tail) { s->tail->next = g; } else { s->head = g; }
+    s->tail = g;
+}
+static void lsched_reap(lsched* s) {
+    /* A finished thread cannot free the stack it is running on */
+    if (s->dead) {
+        lstack_del(s->dead->stack, s->dead->size);
+        free(s->dead);
+        s->dead = NULL;
+    }
+}
+/* Register fd for each direction that has a thread waiting on it */
+static int lsched_arm(lsched* s, int fd) {
+    lfdwait* w = &s->fds[fd];
+    struct epoll_event ev;
+    ev.events = (w->reader ? EPOLLIN : 0) | (w->writer ? EPOLLOUT : 0) | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) == 0) { return 0; }
+    if (errno != ENOENT) { return -1; }
+    return epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+static void lsched_ready(lsched* s, int fd, uint32_t events) {
+    /* Errors and hangups wake both sides so their calls see them */
+    lfdwait* w = &s->fds[fd];
+    if (w->reader && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        lsched_push(s, w->reader);
+        w->reader = NULL;
+        s->waiting--;
+    }
+    if (w->writer && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        lsched_push(s, w->writer);
+        w->writer = NULL;
+        s->waiting--;
+    }
+}
+static void lsched_poll(lsched* s, long timeout) {
+    struct epoll_event ev[64];
+    int n = epoll_wait(s->epfd, ev, 64, timeout);
+
+    /* Registrations are one-shot, so ready threads are simply queued and
+       the fd is armed again for a side that is still waiting */
+    for (int i = 0; i < n; i++) {
+        int fd = ev[i].data.fd;
+        if (fd == s->wakefd) {
+            /* Just a nudge, the woken threads are in the inbox */
+            uint64_t count;
+            while (read(s->wakefd, &count, sizeof(count)) == -1 && errno == EINTR) {}
+            continue;
+        }
+        lsched_ready(s, fd, ev[i].events);
+        lfdwait* w = &s->fds[fd];
+        if ((w->reader || w->writer) && lsched_arm(s, fd) == -1) {
+            lsched_ready(s, fd, EPOLLERR);
+        }
+    }
+}
+static void lsched_inbox(lsched* s) {
+    lgreen* g = atomic_exchange(&s->inbox, NULL);
+    while (g) {
+        lgreen* next = g->next;
+        lsched_push(s, g);
+        s->waiting--;
+        g = next;
+    }
+}
+static lgreen* lsched_next(lsched* s) {
+    for (;;) {
+        if (atomic_load(&s->inbox)) { lsched_inbox(s); }
+
+        /* Move sleepers that are due onto the run queue */
+        long now = lnow_ms();
+        while (s->sleeping && s->sleeping->wake <= now) {
+            lgreen* g = s->sleeping;
+            s->sleeping = g->next;
+            lsched_push(s, g);
+        }
+
+        /* Check for ready I/O without blocking if anything can run,
+           otherwise block until I/O or the first sleeper is due */
+        long timeout = s->head ? 0 : s->sleeping ? s->sleeping->wake - now : -1;
+        if (s->waiting) {
+            lsched_poll(s, timeout);
+        } else if (timeout > 0) {
+            lsleep_ms(timeout);
+        }
+
+        lgreen* g = s->head;
+        if (g) {
+            s->head = g->next;
+            if (!s->head) { s->tail = NULL; }
+            return g;
+        }
+
+        /* Everything left is parked waiting on something else */
+        if (!s->sleeping && !s->waiting) { return NULL; }
+    }
+}
+static void lsched_switch(lsched* s) {
+    /* The current thread must already be queued, sleeping or dead */
+    lgreen* prev = s->current;
+    lgreen* next = lsched_next(s);
+    if (!next || next == prev) { return; }
+
+    s->current = next;
+    lgen* g = lgen_self;
+    char* floor = lstack_floor;
+    swapcontext(&prev->uc, &next->uc);
+    lgen_self = g;
+    lstack_floor = floor;
+    lsched_reap(s);
+}
+static void lgreen_start(unsigned int hi, unsigned int lo) {
+    /* makecontext only passes ints, so the context comes in two halves */
+    lctx* c = (lctx*)(uintptr_t)(((uint64_t)hi << 32) | lo);
+    lsched* s = &c->sched;
+    lsched_reap(s);
+
+    /* Too deep a recursion makes the future's result an error */
+    lgreen* g = s->current;
+    lstack_floor = lstack_limit(g->stack, g->size);
+    lfuture* f = g->fut;
+    lval* x = f->expr;
+    f->expr = NULL;
+    x->type = LVAL_SEXPR;
+    f->result = lval_eval(f->env, x);
+    f->remaining = 0;
+    while (f->waiters) {
+        lgreen* w = f->waiters;
+        f->waiters = w->next;
+        lsched_push(s, w);
+    }
+    lfuture_release(f);
+
+    /* The last thread out wakes whoever is draining */
+    if (--s->count == 0 && s->joiner) {
+        lsched_push(s, s->joiner);
+        s->joiner = NULL;
+    }
+
+    /* Never returns, the next thread to run frees this stack */
+    s->dead = g;
+    lsched_switch(s);
+}
+
+int lsched_yield(lctx* c) {
+    lsched* s = &c->sched;
+    if (!lsched_owned(s) || s->count == 0) { return 0; }
+    lsched_push(s, s->current);
+    lsched_switch(s);
+    return 1;
+}
+void lsched_sleep(lctx* c, long ms) {
+    lsched* s = &c->sched;
+    if (!lsched_owned(s) || s->count == 0) { lsleep_ms(ms); return; }
+
+    /* Insert in wake order, after any sleepers due at the same time */
+    lgreen* g = s->current;
+    g->wake = lnow_ms() + ms;
+    lgreen** p = &s->sleeping;
+    while (*p && (*p)->wake <= g->wake) { p = &(*p)->next; }
+    g->next = *p;
+    *p = g;
+    lsched_switch(s);
+}
+void lsched_drain(lctx* c) {
+    /* Park until the last green thread finishes and wakes us */
+    lsched* s = &c->sched;
+    if (!lsched_owned(s) || s->count == 0) { return; }
+    s->joiner = s->current;
+    lsched_switch(s);
+    s->joiner = NULL;
+}
+int lsched_await(lctx* c, lfuture* f) {
+    lsched* s = &c->sched;
+    if (!lsched_owned(s)) { return 0; }
+
+    /* Park on the future, returning 0 if nothing could ever finish it */
+    lgreen* g = s->current;
+    g->next = f->waiters;
+    f->waiters = g;
+    lsched_switch(s);
+    if (f->remaining == 0) { return 1; }
+
+    lgreen** p = &f->waiters;
+    while (*p != g) { p = &(*p)->next; }
+    *p = g->next;
+    return 0;
+}
+static int lsched_open(lsched* s) {
+    if (s->epfd != -1) { return 0; }
+
+    /* Other threads write to wakefd to get a blocked scheduler's attention */
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epfd == -1) { return -1; }
+    s->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = s->wakefd;
+    if (s->wakefd == -1 || epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wakefd, &ev) == -1) {
+        close(s->epfd);
+        if (s->wakefd != -1) { close(s->wakefd); }
+        s->epfd = -1;
+        s->wakefd = -1;
+        return -1;
+    }
+    return 0;
+}
+void lsched_wake(lsched* s, lgreen* g) {
+    /* The owner can queue it directly */
+    if (lsched_owned(s)) {
+        lsched_push(s, g);
+        s->waiting--;
+        return;
+    }
+
+    /* Anyone else pushes onto the inbox and nudges the owner */
+    g->next = atomic_load(&s->inbox);
+    while (!atomic_compare_exchange_weak(&s->inbox, &g->next, g)) {}
+    uint64_t one = 1;
+    while (write(s->wakefd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+}
+int lsched_wait_fd(lctx* c, int fd, int write) {
+    lsched* s = &c->sched;
+    short events = write ? POLLOUT : POLLIN;
+
+    /* Other threads have no scheduler to return to, so just block */
+    if (!lsched_owned(s)) {
+        struct pollfd p = { fd, events, 0 };
+        return poll(&p, 1, -1) == 1 ? 0 : -1;
+    }
+
+    if (lsched_open(s) == -1) { return -1; }
+
+    /* Grow the table of waiters to cover fd */
+    if (fd >= s->nfds) {
+        int n = s->nfds ? s->nfds : 16;
+        while (n <= fd) { n *= 2; }
+        s->fds = realloc(s->fds, sizeof(lfdwait) * n);
+        memset(s->fds + s->nfds, 0, sizeof(lfdwait) * (n - s->nfds));
+        s->nfds = n;
+    }
+
+    /* A reader and a writer can share an fd, but not two of either */
+    lgreen** slot = write ? &s->fds[fd].writer : &s->fds[fd].reader;
+    if (*slot) { errno = EBUSY; return -1; }
+    *slot = s->current;
+    if (lsched_arm(s, fd) == -1) {
+        *slot = NULL;
+        /* Regular files can't be polled, but are always ready */
+        return errno == EPERM ? 0 : -1;
+    }
+
+    s->waiting++;
+    lsched_switch(s);
+    return 0;
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+    LASSERT_NUM("spawn", a, 1);
+    LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+    lsched* s = &e->ctx->sched;
+    LASSERT(a, lsched_owned(s),
+        "Function 'spawn' can only be called from the interpreter thread.");
+
+    size_t size;
+    char* stack = lstack_new(&size);
+    LASSERT(a, stack, "Function 'spawn' could not allocate a stack.");
+
+    lfuture* f = malloc(sizeof(lfuture));
+    atomic_init(&f->ref, 2);
+    atomic_init(&f->remaining, 1);
+    f->env = lenv_snapshot(e, 0);
+    f->expr = lval_thaw(lval_take(a, 0));
+    f->result = NULL;
+    f->green = 1;
+    f->waiters = NULL;
+
+    lgreen* g = malloc(sizeof(lgreen));
+    g->stack = stack;
+    g->size = size;
+    g->fut = f;
+    getcontext(&g->uc);
+    g->uc.uc_stack.ss_sp = stack + size - LGREEN_STACK;
+    g->uc.uc_stack.ss_size = LGREEN_STACK;
+    g->uc.uc_link = NULL;
+    uint64_t cp = (uint64_t)(uintptr_t)e->ctx;
+    makecontext(&g->uc, (void (*)(void))lgreen_start, 2,
+        (unsigned int)(cp >> 32), (unsigned int)cp);
+
+    /* It starts at the next yield, the spawner keeps running */
+    s->count++;
+    lsched_push(s, g);
+    return lval_future(f);
+}
+lval* builtin_yield(lenv* e, lval* a) {
+    LASSERT_NUM("yield", a, 1);
+
+    /* Inside a generator hand a copy of the argument to its consumer */
+    lgen* g = lgen_self;
+    if (g) {
+        if (g->closing) {
+            lval_del(a);
+            return lval_err("Generator closed.");
+        }
+        g->out = lval_copy(a->cell[0]);
+        char* floor = lstack_floor;
+        swapcontext(&g->uc, &g->caller);
+        lstack_floor = floor;
+        if (g->closing) {
+            lval_del(a);
+            return lval_err("Generator closed.");
+        }
+        return lval_take(a, 0);
+    }
+
+    /* Otherwise hand it back once the other threads have had a turn */
+    lsched_yield(e->ctx);
+    return lval_take(a, 0);
+}
+lval* builtin_sleep(lenv* e, lval* a) {
+    LASSERT_NUM("sleep", a, 1);
+    LASSERT_TYPE("sleep", a, 0, LVAL_NUM);
+    LASSERT(a, a->cell[0]->num >= 0,
+        "Function 'sleep' passed negative time %li.", a->cell[0]->num);
+
+    /* Returns the time slept so a sleep can be an argument to what follows */
+    lsched_sleep(e->ctx, a->cell[0]->num);
+    return lval_take(a, 0);
+}
+
+/* Generators
+
+   (gen f) turns a lambda into a generator function. Calling it returns
+   a lazy sequence instead of running the body, and each cursor over
+   that sequence runs the body on a stack of its own. Every (yield x)
+   inside it suspends the body with its frames intact and hands x to
+   the cursor, which resumes it when the next element is wanted.
+
+   Yields go to the innermost generator being run, so a body can loop
+   by recursing through an ordinary lambda that yields. Calling the
+   generator function itself from its body just returns a new sequence
+   without yielding anything. A body that recurses too deeply for its
+   stack ends the sequence with an error. */
+lval* lgen_call(lenv* e, lval* f, lval* a) {
+    lseq* s = lseq_new(LSEQ_GEN);
+    s->fn = lval_copy(f);
+    s->seed = a;
+    s->env = lenv_snapshot(e, 0);
+    return lval_seq(s);
+}
+
+static void lgen_start(unsigned int hi, unsigned int lo) {
+    /* makecontext only passes ints, so the generator comes in two halves */
+    lgen* g = (lgen*)(uintptr_t)(((uint64_t)hi << 32) | lo);
+    lstack_floor = lstack_limit(g->stack, g->size);
+
+    lval* r = lval_call(g->env, g->fn, g->args);
+    g->args = NULL;
+
+    /* The body's value is discarded, but errors end the sequence */
+    if (r->type == LVAL_ERR && !g->closing) {
+        g->out = r;
+    } else {
+        g->out = NULL;
+        lval_del(r);
+    }
+    g->done = 1;
+    swapcontext(&g->uc, &g->caller);
+}
+
+lgen* lgen_new(lseq* s) {
+    lgen* g = malloc(sizeof(lgen));
+    g->stack = NULL;
+    g->env = lenv_copy(s->env);
+    g->fn = lval_copy(s->fn);
+    g->args = lval_copy(s->seed);
+    g->out = NULL;
+    g->done = 0;
+    g->closing = 0;
+    g->prev = NULL;
+    return g;
+}
+void lgen_del(lgen* g) {
+    /* Unwind a suspended body so everything on its stack is freed. Each
+       yield from here on returns an error, which ends the evaluation. */
+    if (g->stack && !g->done) {
+        g->closing = 1;
+        while (!g->done) {
+            lval* x = lgen_next(g);
+            if (x) { lval_del(x); }
+        }
+    }
+    if (g->stack) { lstack_del(g->stack, g->size); }
+    if (g->args) { lval_del(g->args); }
+    lval_del(g->fn);
+    lenv_del(g->env);
+    free(g);
+}
+lval* lgen_next(lgen* g) {
+    if (g->done) { return NULL; }
+
+    /* The stack is only mapped once the first element is wanted */
+    if (!g->stack) {
+        g->stack = lstack_new(&g->size);
+        if (!g->stack) {
+            g->done = 1;
+            return lval_err("Generator could not allocate a stack.");
+        }
+        getcontext(&g->uc);
+        g->uc.uc_stack.ss_sp = g->stack + g->size - LGREEN_STACK;
+        g->uc.uc_stack.ss_size = LGREEN_STACK;
+        g->uc.uc_link = NULL;
+        uint64_t gp = (uint64_t)(uintptr_t)g;
+        makecontext(&g->uc, (void (*)(void))lgen_start, 2,
+            (unsigned int)(gp >> 32), (unsigned int)gp);
+    }
+
+    /* Run the body until its next yield, nesting inside any generator
+       that is resuming this one */
+    g->prev = lgen_self;
+    lgen_self = g;
+    char* floor = lstack_floor;
+    swapcontext(&g->caller, &g->uc);
+    lgen_self = g->prev;
+    lstack_floor = floor;
+
+    lval* x = g->out;
+    g->out = NULL;
+    return x;
+}
+
+lval* builtin_gen(lenv* e, lval* a) {
+    LASSERT_NUM("gen", a, 1);
+    LASSERT_TYPE("gen", a, 0, LVAL_FUN);
+    LASSERT(a, !a->cell[0]->builtin,
+        "Function 'gen' passed a builtin, expected a lambda.");
+
+    lval* v = lval_fun(NULL);
+    v->gen = lval_take(a, 0);
+    return v;
+}
+
+/* Asynchronous I/O
+
+   Descriptors are opened non-blocking and passed around as numbers. An
+   operation that would block parks the calling green thread on the
+   scheduler's epoll instance, so one thread can keep many streams busy
+   while other green threads run. Timers are green threads that sleep
+   and then call back into a lambda. */
+#define LASSERT_IO(args, cond, func) \
+    LASSERT(args, cond, "Function '%s' failed: %s.", func, strerror(errno))
+
+lval* builtin_open(lenv* e, lval* a) {
+    LASSERT_NUM("open", a, 2);
+    LASSERT_TYPE("open", a, 0, LVAL_STR);
+    LASSERT_TYPE("open", a, 1, LVAL_STR);
+
+    /* Mode is one of "r", "w", "a" or "rw" */
+    char* m = a->cell[1]->str;
+    int flags;
+    if (strcmp(m, "r") == 0) { flags = O_RDONLY; }
+    else if (strcmp(m, "w") == 0) { flags = O_WRONLY | O_CREAT | O_TRUNC; }
+    else if (strcmp(m, "a") == 0) { flags = O_WRONLY | O_CREAT | O_APPEND; }
+    else if (strcmp(m, "rw") == 0) { flags = O_RDWR | O_CREAT; }
+    else {
+        lval* err = lval_err("Function 'open' passed unknown mode \"%s\".", m);
+        lval_del(a);
+        return err;
+    }
+
+    int fd = open(a->cell[0]->str, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    LASSERT_IO(a, fd != -1, "open");
+    lval_del(a);
+    return lval_num(fd);
+}
+lval* builtin_read(lenv* e, lval* a) {
+    LASSERT_NUM("read", a, 2);
+    LASSERT_TYPE("read", a, 0, LVAL_NUM);
+    LASSERT_TYPE("read", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num > 0,
+        "Function 'read' passed size %li, expected at least 1.", a->cell[1]->num);
+
+    /* Returns up to n bytes as a string, which is empty at end of file.
+       Strings are NUL terminated, so this is for text: anything after a
+       NUL byte in what was read is dropped. */
+    int fd = a->cell[0]->num;
+    long n = a->cell[1]->num;
+    char* buf = malloc(n + 1);
+    LASSERT(a, buf, "Function 'read' could not allocate %li bytes.", n);
+    ssize_t got;
+    while ((got = read(fd, buf, n)) == -1) {
+        if (errno == EINTR) { continue; }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK)
+            || lsched_wait_fd(e->ctx, fd, 0) == -1) { break; }
+    }
+    if (got == -1) { free(buf); }
+    LASSERT_IO(a, got != -1, "read");
+
+    buf[got] = '\0';
+    lval* x = lval_str(buf);
+    free(buf);
+    lval_del(a);
+    return x;
+}
+lval* builtin_write(lenv* e, lval* a) {
+    LASSERT_NUM("write", a, 2);
+    LASSERT_TYPE("write", a, 0, LVAL_NUM);
+    LASSERT_TYPE("write", a, 1, LVAL_STR);
+
+    /* Keep going until everything is written, parking while full */
+    int fd = a->cell[0]->num;
+    char* str = a->cell[1]->str;
+    size_t len = strlen(str);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, str + done, len - done);
+        if (n >= 0) { done += n; continue; }
+        if (errno == EINTR) { continue; }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK)
+            || lsched_wait_fd(e->ctx, fd, 1) == -1) { break; }
+    }
+    LASSERT_IO(a, done == len, "write");
+
+    lval_del(a);
+    return lval_num(len);
+}
+lval* builtin_close(lenv* e, lval* a) {
+    if (a->count == 1 && a->cell[0]->type == LVAL_CHAN) {
+        return builtin_chan_close(e, a);
+    }
+    LASSERT_NUM("close", a, 1);
+    LASSERT_TYPE("close", a, 0, LVAL_NUM);
+
+    /* Closing also removes the descriptor from the epoll instance */
+    LASSERT_IO(a, close(a->cell[0]->num) == 0, "close");
+    lval_del(a);
+    return lval_sexpr();
+}
+lval* builtin_listen(lenv* e, lval* a) {
+    LASSERT_NUM("listen", a, 1);
+    LASSERT_TYPE("listen", a, 0, LVAL_NUM);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    LASSERT_IO(a, fd != -1, "listen");
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(a->cell[0]->num);
+    int ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && listen(fd, SOMAXCONN) == 0;
+    if (!ok) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    LASSERT_IO(a, ok, "listen");
+    lval_del(a);
+    return lval_num(fd);
+}
+lval* builtin_accept(lenv* e, lval* a) {
+    LASSERT_NUM("accept", a, 1);
+    LASSERT_TYPE("accept", a, 0, LVAL_NUM);
+
+    int fd = a->cell[0]->num;
+    int c;
+    while ((c = accept(fd, NULL, NULL)) == -1) {
+        if (errno == EINTR) { continue; }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK)
+            || lsched_wait_fd(e->ctx, fd, 0) == -1) { break; }
+    }
+    LASSERT_IO(a, c != -1, "accept");
+    fcntl(c, F_SETFL, fcntl(c, F_GETFL) | O_NONBLOCK);
+    fcntl(c, F_SETFD, FD_CLOEXEC);
+    lval_del(a);
+    return lval_num(c);
+}
+lval* builtin_connect(lenv* e, lval* a) {
+    LASSERT_NUM("connect", a, 2);
+    LASSERT_TYPE("connect", a, 0, LVAL_STR);
+    LASSERT_TYPE("connect", a, 1, LVAL_NUM);
+
+    /* Hosts are dotted IPv4 addresses, name lookups would block */
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(a->cell[1]->num);
+    LASSERT(a, inet_pton(AF_INET, a->cell[0]->str, &addr.sin_addr) == 1,
+        "Function 'connect' passed invalid address \"%s\".", a->cell[0]->str);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    LASSERT_IO(a, fd != -1, "connect");
+
+    /* The connection completes in the background, then reports its error */
+    int r = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (r == -1 && errno == EINPROGRESS && lsched_wait_fd(e->ctx, fd, 1) == 0) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        r = err ? -1 : 0;
+        errno = err;
+    }
+    if (r == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    LASSERT_IO(a, r == 0, "connect");
+    lval_del(a);
+    return lval_num(fd);
+}
+lval* builtin_after(lenv* e, lval* a) {
+    LASSERT_NUM("after", a, 2);
+    LASSERT_TYPE("after", a, 0, LVAL_NUM);
+    LASSERT_TYPE("after", a, 1, LVAL_FUN);
+    LASSERT(a, a->cell[0]->num >= 0,
+        "Function 'after' passed negative time %li.", a->cell[0]->num);
+
+    /* Spawn {f (sleep ms)}, so f is called with the delay once it passes */
+    lval* q = lval_qexpr();
+    lval_add(q, lval_pop(a, 1));
+    lval_add(q, lval_add(lval_add(lval_sexpr(), lval_fun(builtin_sleep)),
+        lval_pop(a, 0)));
+    lval_del(a);
+    return builtin_spawn(e, lval_add(lval_sexpr(), q));
+}
+
+/* Atoms
+
+   An atom holds a pointer to an immutable value and is updated by
+   swapping in a new one with a CAS, retrying if another thread got there
+   first. Readers enter the atom's current epoch while they load and copy
+   the value, counted under the epoch's parity. A replaced value goes on a
+   retire list tagged with the epoch it was replaced in. The epoch only
+   moves on once nobody is left in the one before it, so when it is two
+   past a value's tag every reader that could have loaded the value has
+   left, and it is freed. A reader held for a long time only stops the
+   epoch two steps on, so values retired before it still get freed and
+   the list stays bounded. Holding an epoch over a swap attempt also
+   rules out ABA, since the value compared against can't be freed and
+   its address reused in between. */
+lval* lval_atom(latom* a) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_ATOM;
+    v->hashed = 0;
+    v->interned = NULL;
+    v->atom = a;
+    return v;
+}
+static void latom_free_list(lretired* r) {
+    while (r) {
+        lretired* next = r->next;
+        lval_del(r->val);
+        free(r);
+        r = next;
+    }
+}
+static void latom_push(latom* a, lretired* first, lretired* last) {
+    last->next = atomic_load(&a->retired);
+    while (!atomic_compare_exchange_weak(&a->retired, &last->next, first)) {}
+}
+static void latom_retire(latom* a, lval* v) {
+    lretired* r = malloc(sizeof(lretired));
+    r->val = v;
+    /* Read after v was swapped out, so any reader of v entered no later */
+    r->epoch = atomic_load(&a->epoch);
+    latom_push(a, r, r);
+}
+static long latom_enter(latom* a) {
+    for (;;) {
+        long ep = atomic_load(&a->epoch);
+        atomic_fetch_add(&a->readers[ep & 1], 1);
+        /* The epoch may have moved on before we were counted */
+        if (atomic_load(&a->epoch) == ep) { return ep; }
+        atomic_fetch_sub(&a->readers[ep & 1], 1);
+    }
+}
+
+/* Move to the next epoch if nobody is left in the previous one */
+static void latom_advance(latom* a) {
+    long ep = atomic_load(&a->epoch);
+    if (atomic_load(&a->readers[(ep + 1) & 1]) != 0) { return; }
+    atomic_compare_exchange_strong(&a->epoch, &ep, ep + 1);
+}
+
+/* Free the retired values no reader can still hold */
+static void latom_collect(latom* a) {
+    if (!atomic_load(&a->retired)) { return; }
+    latom_advance(a);
+    latom_advance(a);
+    long now = atomic_load(&a->epoch);
+
+    lretired* r = atomic_exchange(&a->retired, NULL);
+    lretired* keep = NULL;
+    lretired* last = NULL;
+    while (r) {
+        lretired* next = r->next;
+        if (now - r->epoch >= 2) {
+            lval_del(r->val);
+            free(r);
+        } else {
+            r->next = keep;
+            keep = r;
+            if (!last) { last = r; }
+        }
+        r = next;
+    }
+    if (keep) { latom_push(a, keep, last); }
+}
+static void latom_leave(latom* a, long ep) {
+    atomic_fetch_sub(&a->readers[ep & 1], 1);
+    latom_collect(a);
+}
+void latom_release(latom* a) {
+    if (atomic_fetch_sub(&a->ref, 1) > 1) { return; }
+    latom_free_list(a->retired);
+    lval_del(a->val);
+    free(a);
+}
+lval* latom_deref(latom* a) {
+    long ep = latom_enter(a);
+    lval* x = lval_copy(atomic_load(&a->val));
+    latom_leave(a, ep);
+    return x;
+}
+
+/* Install v if the atom still holds old, returning 1 on success */
+static int latom_cas(latom* a, lval* old, lval* v) {
+    /* Fill in any cached hashes before other threads can see v */
+    lval_hash(v);
+    if (!atomic_compare_exchange_strong(&a->val, &old, v)) { return 0; }
+    latom_retire(a, old);
+    return 1;
+}
+
+lval* builtin_atom(lenv* e, lval* a) {
+    LASSERT_NUM("atom", a, 1);
+
+    latom* x = malloc(sizeof(latom));
+    atomic_init(&x->ref, 1);
+    lval* v = lval_take(a, 0);
+    lval_hash(v);
+    atomic_init(&x->val, v);
+    atomic_init(&x->epoch, 0);
+    atomic_init(&x->readers[0], 0);
+    atomic_init(&x->readers[1], 0);
+    atomic_init(&x->retired, NULL);
+    return lval_atom(x);
+}
+lval* builtin_deref(lenv* e, lval* a) {
+    LASSERT_NUM("deref", a, 1);
+    LASSERT_TYPE("deref", a, 0, LVAL_ATOM);
+
+    lval* x = latom_deref(a->cell[0]->atom);
+    lval_del(a);
+    return x;
+}
+lval* builtin_swap(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 2,
+        "Function 'swap!' passed incorrect number of arguments. "
+        "Got %i, expected at least %i.", a->count, 2);
+    LASSERT_TYPE("swap!", a, 0, LVAL_ATOM);
+    LASSERT_TYPE("swap!", a, 1, LVAL_FUN);
+
+    /* (swap! a f x ...) replaces the value v with (f v x ...) */
+    latom* x = a->cell[0]->atom;
+    lval* f = a->cell[1];
+    lval* r;
+    long ep = latom_enter(x);
+    for (;;) {
+        lval* old = atomic_load(&x->val);
+        lval* args = lval_add(lval_sexpr(), lval_copy(old));
+        for (int i = 2; i < a->count; i++) {
+            lval_add(args, lval_copy(a->cell[i]));
+        }
+
+        lval* fc = lval_copy(f);
+        lval* v = lval_call(e, fc, args);
+        lval_del(fc);
+        if (v->type == LVAL_ERR) { r = v; break; }
+
+        /* Another thread swapped first, so call f again on its value */
+        if (latom_cas(x, old, v)) { r = lval_copy(v); break; }
+        lval_del(v);
+
+        /* Start the retry in a fresh epoch so old can be freed */
+        latom_leave(x, ep);
+        ep = latom_enter(x);
+    }
+    latom_leave(x, ep);
+
+    lval_del(a);
+    return r;
+}
+lval* builtin_reset(lenv* e, lval* a) {
+    LASSERT_NUM("reset!", a, 2);
+    LASSERT_TYPE("reset!", a, 0, LVAL_ATOM);
+
+    latom* x = a->cell[0]->atom;
+    lval* v = lval_pop(a, 1);
+    lval* r = lval_copy(v);
+    lval_hash(v);
+    latom_retire(x, atomic_exchange(&x->val, v));
+
+    /* Give the retired value a chance to be freed */
+    latom_collect(x);
+
+    lval_del(a);
+    return r;
+}
+lval* builtin_cas(lenv* e, lval* a) {
+    LASSERT_NUM("cas!", a, 3);
+    LASSERT_TYPE("cas!", a, 0, LVAL_ATOM);
+
+    /* (cas! a old new) sets new only if the value still equals old */
+    latom* x = a->cell[0]->atom;
+    int ok = 0;
+    long ep = latom_enter(x);
+    lval* cur = atomic_load(&x->val);
+    if (lval_eq(cur, a->cell[1])) {
+        lval* v = lval_pop(a, 2);
+        ok = latom_cas(x, cur, v);
+        if (!ok) { lval_del(v); }
+    }
+    latom_leave(x, ep);
+
+    lval_del(a);
+    return lval_num(ok);
+}
+
+/* Channels
+
+   (chan n) makes a channel holding up to n values. (chan 0) holds none,
+   so a send waits until a receiver has taken its value, and (chan -1)
+   holds any number. send and recv move copies of values through it,
+   parking the calling green thread while the channel is full or empty. Threads
+   that can't park, like pool workers, help with pool work between
+   retries instead of blocking. recv on a closed and drained channel
+   returns (). */
+lval* lval_chan(lchan* c) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_CHAN;
+    v->hashed = 0;
+    v->interned = NULL;
+    v->chan = c;
+    return v;
+}
+void lchan_release(lchan* c) {
+    if (atomic_fetch_sub(&c->ref, 1) > 1) { return; }
+    if (c->cap >= 0) {
+        lring_free(&c->ring);
+    } else {
+        for (long i = 0; i < c->count; i++) {
+            lval_del(c->buf[(c->first + i) % c->size]);
+        }
+        free(c->buf);
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+/* Wake the first parked thread on a queue, or all of them */
+static void lchan_wake(lchan* c, lwnode** q, atomic_int* n, int all) {
+    /* The caller's push or pop must be visible before the count is read,
+       pairing with the fence after parking. Otherwise this could see no
+       waiters while a waiter's re-check still sees the old contents, and
+       it would sleep forever. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(n) == 0) { return; }
+    pthread_mutex_lock(&c->lock);
+    for (lwnode* x = *q; x; x = x->next) {
+        /* Skip threads already woken through another channel */
+        int zero = 0;
+        if (atomic_compare_exchange_strong(&x->w->state, &zero, 1)) {
+            lsched_wake(x->w->sched, x->w->green);
+            if (!all) { break; }
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Try to send v, setting at to the ring position it went to */
+static int lchan_try_send(lchan* c, lval* v, size_t* at) {
+    if (c->closed) { return -1; }
+
+    int ok = 1;
+    if (c->cap >= 0) {
+        ok = lring_push(&c->ring, v, at);
+    } else {
+        pthread_mutex_lock(&c->lock);
+        if (c->count == c->size) {
+            /* Grow, unwrapping the contents to the start of the new buffer */
+            long size = c->size * 2;
+            lval** buf = malloc(sizeof(lval*) * size);
+            for (long i = 0; i < c->count; i++) {
+                buf[i] = c->buf[(c->first + i) % c->size];
+            }
+            free(c->buf);
+            c->buf = buf;
+            c->size = size;
+            c->first = 0;
+        }
+        c->buf[(c->first + c->count) % c->size] = v;
+        c->count++;
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if (ok) { lchan_wake(c, &c->recvq, &c->nrecv, 0); }
+    return ok;
+}
+static lval* lchan_pop(lchan* c) {
+    if (c->cap >= 0) {
+        /* A rendezvous sender parks until its value is taken, so wake
+           them all rather than one that may still have room to wait for */
+        lval* v = lring_pop(&c->ring);
+        if (v) { lchan_wake(c, &c->sendq, &c->nsend, c->cap == 0); }
+        return v;
+    }
+
+    lval* v = NULL;
+    pthread_mutex_lock(&c->lock);
+    if (c->count) {
+        v = c->buf[c->first];
+        c->first = (c->first + 1) % c->size;
+        c->count--;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return v;
+}
+static int lchan_try_recv(lchan* c, lval** v) {
+    if ((*v = lchan_pop(c))) { return 1; }
+    if (!c->closed) { return 0; }
+
+    /* Closed, but a send may have landed just before that */
+    if ((*v = lchan_pop(c))) { return 1; }
+    *v = lval_sexpr();
+    return -1;
+}
+
+/* Park on a set of channels, the queue chosen by sending. Returns 0 if
+   this thread has no scheduler to park with. */
+static int lchan_park_begin(lenv* e, lwaiter* w, lwnode* nodes,
+        lchan** cs, int n, int sending) {
+    lsched* s = &e->ctx->sched;
+    if (!lsched_owned(s) || lsched_open(s) == -1) { return 0; }
+
+    atomic_init(&w->state, 0);
+    w->sched = s;
+    w->green = s->current;
+    s->waiting++;
+    for (int i = 0; i < n; i++) {
+        lchan* c = cs[i];
+        nodes[i].w = w;
+        pthread_mutex_lock(&c->lock);
+        lwnode** q = sending ? &c->sendq : &c->recvq;
+        nodes[i].next = *q;
+        *q = &nodes[i];
+        atomic_fetch_add(sending ? &c->nsend : &c->nrecv, 1);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    /* Registered before the caller checks the channels again */
+    atomic_thread_fence(memory_order_seq_cst);
+    return 1;
+}
+static void lchan_park_end(lwaiter* w, lwnode* nodes, lchan** cs, int n,
+        int sending, int ready) {
+    /* Ready after all, so call off the wait unless a wake got there first,
+       in which case it has already queued this thread to run again */
+    int zero = 0;
+    if (ready && atomic_compare_exchange_strong(&w->state, &zero, 2)) {
+        w->sched->waiting--;
+    } else {
+        lsched_switch(w->sched);
+    }
+
+    for (int i = 0; i < n; i++) {
+        lchan* c = cs[i];
+        pthread_mutex_lock(&c->lock);
+        lwnode** q = sending ? &c->sendq : &c->recvq;
+        while (*q != &nodes[i]) { q = &(*q)->next; }
+        *q = nodes[i].next;
+        atomic_fetch_sub(sending ? &c->nsend : &c->nrecv, 1);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+static void lchan_spin(lenv* e) {
+    /* Workers must never block, so do some other work while waiting */
+    lpool* p = e->ctx->pool;
+    ltask* t = p ? lpool_find(p) : NULL;
+    if (t) { t->run(t); } else { sched_yield(); }
+}
+
+lval* builtin_chan(lenv* e, lval* a) {
+    LASSERT_NUM("chan", a, 1);
+    LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+    LASSERT(a, a->cell[0]->num >= -1,
+        "Function 'chan' passed size %li, expected -1 for unbounded or more.",
+        a->cell[0]->num);
+
+    lchan* c = malloc(sizeof(lchan));
+    atomic_init(&c->ref, 1);
+
+    /* A rendezvous channel passes each value through a ring of one */
+    c->cap = a->cell[0]->num;
+    c->buf = NULL;
+    if (c->cap >= 0) {
+        lring_init(&c->ring, c->cap ? c->cap : 1);
+    } else {
+        c->size = 16;
+        c->first = 0;
+        c->count = 0;
+        c->buf = malloc(sizeof(lval*) * c->size);
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+    c->recvq = NULL;
+    c->sendq = NULL;
+    atomic_init(&c->nrecv, 0);
+    atomic_init(&c->nsend, 0);
+    atomic_init(&c->closed, 0);
+
+    lval_del(a);
+    return lval_chan(c);
+}
+lval* builtin_chan_send(lenv* e, lval* a) {
+    lchan* c = a->cell[0]->chan;
+    lval* v = lval_pop(a, 1);
+    lval_hash(v);
+
+    int r;
+    size_t at;
+    for (;;) {
+        if ((r = lchan_try_send(c, v, &at))) { break; }
+
+        lwaiter w;
+        lwnode node;
+        if (!lchan_park_begin(e, &w, &node, &c, 1, 1)) { lchan_spin(e); continue; }
+        r = lchan_try_send(c, v, &at);
+        lchan_park_end(&w, &node, &c, 1, 1, r != 0);
+        if (r) { break; }
+    }
+
+    if (r == -1) { lval_del(v); }
+    LASSERT(a, r == 1, "Function 'send' passed a closed channel.");
+
+    /* On a rendezvous channel wait for a receiver to take the value. A
+       receiver claims it by moving tail past its position. Closing the
+       channel also ends the wait, leaving the value to be drained. */
+    while (c->cap == 0 && atomic_load(&c->ring.tail) <= at && !c->closed) {
+        lwaiter w;
+        lwnode node;
+        if (!lchan_park_begin(e, &w, &node, &c, 1, 1)) { lchan_spin(e); continue; }
+        int done = atomic_load(&c->ring.tail) > at || c->closed;
+        lchan_park_end(&w, &node, &c, 1, 1, done);
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+lval* builtin_recv(lenv* e, lval* a) {
+    LASSERT_NUM("recv", a, 1);
+    LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+
+    lchan* c = a->cell[0]->chan;
+    lval* v;
+    for (;;) {
+        if (lchan_try_recv(c, &v)) { break; }
+
+        lwaiter w;
+        lwnode node;
+        if (!lchan_park_begin(e, &w, &node, &c, 1, 0)) { lchan_spin(e); continue; }
+        int r = lchan_try_recv(c, &v);
+        lchan_park_end(&w, &node, &c, 1, 0, r != 0);
+        if (r) { break; }
+    }
+
+    lval_del(a);
+    return v;
+}
+lval* builtin_select(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1,
+        "Function 'select' passed incorrect number of arguments. "
+        "Got %i, expected at least %i.", a->count, 1);
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("select", a, i, LVAL_CHAN);
+    }
+
+    /* Returns {i v} for the first channel found ready, starting the scan
+       at a different one each call so none of them is starved */
+    static _Thread_local unsigned int turn = 0;
+    int n = a->count;
+    lchan** cs = malloc(sizeof(lchan*) * n);
+    for (int i = 0; i < n; i++) { cs[i] = a->cell[i]->chan; }
+
+    lval* v = NULL;
+    int which = -1;
+    for (;;) {
+        int start = turn++ % n;
+        for (int k = 0; k < n && which == -1; k++) {
+            int i = (start + k) % n;
+            if (lchan_try_recv(cs[i], &v)) { which = i; }
+        }
+        if (which != -1) { break; }
+
+        lwaiter w;
+        lwnode* nodes = malloc(sizeof(lwnode) * n);
+        if (!lchan_park_begin(e, &w, nodes, cs, n, 0)) {
+            free(nodes);
+            lchan_spin(e);
+            continue;
+        }
+        for (int i = 0; i < n && which == -1; i++) {
+            if (lchan_try_recv(cs[i], &v)) { which = i; }
+        }
+        lchan_park_end(&w, nodes, cs, n, 0, which != -1);
+        free(nodes);
+
+        /* A wake from one channel may have been spent on taking from
+           another, so pass it on to anyone else parked on the rest */
+        if (w.state == 1) {
+            for (int i = 0; i < n; i++) {
+                if (i != which) { lchan_wake(cs[i], &cs[i]->recvq, &cs[i]->nrecv, 0); }
+            }
+        }
+        if (which != -1) { break; }
+    }
+
+    free(cs);
+    lval_del(a);
+    return lval_add(lval_add(lval_qexpr(), lval_num(which)), v);
+}
+lval* builtin_chan_close(lenv* e, lval* a) {
+    /* Wake everyone parked so they see the channel closed */
+    lchan* c = a->cell[0]->chan;
+    c->closed = 1;
+    lchan_wake(c, &c->recvq, &c->nrecv, 1);
+    lchan_wake(c, &c->sendq, &c->nsend, 1);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* Background sweeping
+
+   Values are freed as soon as their last owner lets go, so there is no
+   collector to pause for, but dropping a list or map with millions of
+   elements still stalls the thread that drops it while it walks and
+   frees every element. Containers over LSWEEP_MIN elements are instead
+   pushed onto a lock-free stack and freed by a sweeper thread. A dead
+   value is unreachable by definition, so the sweeper needs no barriers
+   or coordination with the threads still running Lisp code.
+
+   Each context has its own sweeper. lval_del has no environment to find
+   it through, so evaluation records the context it runs for on the
+   thread. Values dropped outside any evaluation, and nested ones the
+   sweeper comes across, are freed in line. */
+static _Thread_local lctx* lsweep_ctx = NULL;
+
+/* Make c the thread's current context, returning the previous one */
+lctx* lsweep_swap(lctx* c) {
+    lctx* prev = lsweep_ctx;
+    lsweep_ctx = c;
+    return prev;
+}
+
+static void* lsweep_run(void* arg) {
+    lsweep* s = arg;
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!atomic_load(&s->head) && !s->quit) {
+            pthread_cond_wait(&s->wake, &s->lock);
+        }
+        int quit = s->quit && !atomic_load(&s->head);
+        pthread_mutex_unlock(&s->lock);
+        if (quit) { break; }
+
+        lsweep_node* n = atomic_exchange(&s->head, NULL);
+        while (n) {
+            lsweep_node* next = n->next;
+            lval_del(n->val);
+            free(n);
+            n = next;
+
+            if (atomic_fetch_sub(&s->pending, 1) == 1) {
+                pthread_mutex_lock(&s->lock);
+                pthread_cond_broadcast(&s->done);
+                pthread_mutex_unlock(&s->lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Start the sweeper thread if needed, returning 0 if there is none */
+static int lsweep_start(lsweep* s) {
+    if (atomic_load(&s->started)) { return atomic_load(&s->started) == 1; }
+    pthread_mutex_lock(&s->lock);
+    if (!atomic_load(&s->started)) {
+        int ok = pthread_create(&s->thread, NULL, lsweep_run, s) == 0;
+        atomic_store(&s->started, ok ? 1 : -1);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return atomic_load(&s->started) == 1;
+}
+
+int lsweep_defer(lval* v) {
+    if (!lsweep_ctx) { return 0; }
+
+    int big = 0;
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            big = v->count >= LSWEEP_MIN;
+            break;
+
+        /* A shared table is only a reference to drop */
+        case LVAL_MAP:
+            big = v->count >= LSWEEP_MIN && atomic_load(&v->dict->ref) == 1;
+            break;
+    }
+    if (!big) { return 0; }
+
+    lsweep* s = &lsweep_ctx->sweep;
+    if (!lsweep_start(s)) { return 0; }
+    lsweep_node* n = malloc(sizeof(lsweep_node));
+    n->val = v;
+    atomic_fetch_add(&s->pending, 1);
+    lsweep_node* head = atomic_load(&s->head);
+    do { n->next = head; } while (!atomic_compare_exchange_weak(&s->head, &head, n));
+
+    /* Only the push onto an empty stack needs to wake the sweeper, and n
+       may already be freed so check the old head rather than n->next */
+    if (!head) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return 1;
+}
+void lsweep_flush(lsweep* s) {
+    pthread_mutex_lock(&s->lock);
+    while (atomic_load(&s->pending) > 0) {
+        pthread_cond_wait(&s->done, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
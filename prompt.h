@@ -1,15 +1,37 @@
 /* Forward declarations */
 struct lval;
 struct lenv;
+struct lentry;
+struct ldict;
+struct lhamt;
+struct lmemo;
+struct lseq;
+struct lctx;
+struct lfuture;
+struct lactor;
+struct latom;
+struct lchan;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lentry lentry;
+typedef struct ldict ldict;
+typedef struct lhamt lhamt;
+typedef struct lmemo lmemo;
+typedef struct lseq lseq;
+typedef struct lctx lctx;
+typedef struct lfuture lfuture;
+typedef struct lactor lactor;
+typedef struct latom latom;
+typedef struct lchan lchan;
 
 /* Function pointer type */
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
 /* Create Enumeration of possible lval Types */
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, 
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_MAP, LVAL_PMAP, LVAL_SEQ, LVAL_FUTURE,
+       LVAL_ACTOR, LVAL_ATOM, LVAL_CHAN };
 
 /*Declare New lval Struct */
 struct lval {
@@ -28,26 +50,398 @@ struct lval {
   lenv* env;
   lval* formals;
   lval* body;
+  lmemo* memo;
+  lval* gen;
 
   /* Expression */
   int count;
   struct lval** cell;
+
+  /* Map (count is the number of entries) */
+  ldict* dict;
+  lhamt* root;
+
+  /* Lazy sequence */
+  lseq* seq;
+
+  /* Future */
+  lfuture* fut;
+
+  /* Actor */
+  lactor* actor;
+
+  /* Atom */
+  latom* atom;
+
+  /* Channel */
+  lchan* chan;
+
+  /* Cached structural hash, valid while hashed is set */
+  uint64_t hash;
+  int hashed;
+
+  /* Hash-consed values are shared, counted by ref, and point at the
+     table they are stored in */
+  struct ltable* interned;
+  atomic_int ref;
+};
+
+/* Hash table entry, chained per bucket */
+struct lentry {
+  uint64_t hash;
+  lval* key;
+  lval* val;
+  lentry* next;
+};
+
+/* Buckets of a hash table map, shared by copies of it until one of
+   them is changed and takes a private copy. The map's hash is kept as a
+   running sum over its entries. */
+struct ldict {
+  atomic_int ref;
+  int slots;
+  lentry** buckets;
+  uint64_t sum;
+};
+
+/* Cache of a memoized function, shared between copies */
+typedef struct lmemo_entry lmemo_entry;
+struct lmemo_entry {
+  uint64_t hash;
+  lval* args;
+  lval* result;
+  lmemo_entry* next;
+  lmemo_entry* newer;
+  lmemo_entry* older;
+};
+
+struct lmemo {
+  atomic_int ref;
+  lval* fun;
+  int limit;
+  int count;
+  int slots;
+  lmemo_entry** buckets;
+  lmemo_entry* newest;
+  lmemo_entry* oldest;
+  long hits;
+  long misses;
+  pthread_mutex_t lock;
+};
+
+/* Description of a lazy sequence, shared between copies */
+enum { LSEQ_RANGE, LSEQ_LIST, LSEQ_ITERATE,
+       LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE, LSEQ_GEN };
+
+struct lseq {
+  atomic_int ref;
+  int kind;
+  long start;
+  long end;
+  long step;
+  lval* fn;
+  lval* seed;
+  lseq* src;
+  lenv* env;
+};
+
+/* Suspended run of a generator body. It has a stack of its own and
+   switches back to whoever resumed it at each yield. */
+typedef struct lgen {
+  ucontext_t uc;
+  ucontext_t caller;
+  char* stack;
+  size_t size;
+  lenv* env;
+  lval* fn;
+  lval* args;
+  lval* out;
+  int done;
+  int closing;
+  struct lgen* prev;
+} lgen;
+
+/* Position of one traversal of a sequence */
+typedef struct lcursor {
+  lseq* seq;
+  long i;
+  lval* cur;
+  struct lcursor* src;
+  lgen* gen;
+} lcursor;
+
+/* Set of lentry chains, used for the table of hash-consed values. A table
+   outliving its context is orphaned and freed with its last entry. */
+typedef struct ltable {
+  int count;
+  int slots;
+  int orphaned;
+  lentry** buckets;
+  pthread_mutex_t lock;
+} ltable;
+
+/* Work stealing thread pool
+
+   Each worker owns a Chase-Lev deque: it pushes and takes tasks at the
+   bottom while idle workers steal from the top. Threads outside the pool
+   hand work in through the inject list. */
+#define LDEQUE_SIZE 1024
+
+typedef struct ltask {
+  void (*run)(struct ltask*);
+  void* job;
+  long lo;
+  long hi;
+  struct ltask* next;
+} ltask;
+
+typedef struct {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(ltask*) buf[LDEQUE_SIZE];
+} ldeque;
+
+typedef struct lpool {
+  int count;
+  pthread_t* threads;
+  ldeque* deques;
+  _Atomic(ltask*) inject;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  atomic_int pending;
+  int quit;
+} lpool;
+
+/* A parallel map or reduce over the elements of a list */
+typedef struct {
+  lpool* pool;
+  lenv* e;
+  lval* f;
+  lval** in;
+  lval** out;
+  long* ends;
+  long grain;
+  int reduce;
+  atomic_long remaining;
+} lpjob;
+
+/* Persistent hash array mapped trie node, shared between copies */
+typedef struct {
+  uint64_t hash;
+  lval* key;
+  lval* val;
+  lhamt* sub;
+} lslot;
+
+struct lhamt {
+  atomic_int ref;
+  int count;
+  uint32_t bitmap;
+  lslot* slots;
+  _Atomic uint64_t hash;
+  atomic_int hashed;
 };
 
 /* Variable environment struct */
 struct lenv {
+    lctx* ctx;
     lenv* par;
     int count;
     char** syms;
     lval** vals;
 };
 
+/* Result of an expression evaluated on a pool worker */
+struct lfuture {
+  atomic_int ref;
+  lenv* env;
+  lval* expr;
+  lval* result;
+  atomic_long remaining;
+
+  /* Set for green threads, which wake their awaiters directly */
+  int green;
+  struct lgreen* waiters;
+};
+
+/* Bounded lock-free ring of values. Each cell's seq says whether it is
+   free for a sender at that position or filled for a receiver, so any
+   number of threads can push and pop without a lock. The ring has a
+   power of two cells, count holds it to the requested limit. */
+typedef struct {
+  atomic_size_t seq;
+  lval* msg;
+} lcell;
+
+typedef struct {
+  lcell* cells;
+  size_t mask;
+  long limit;
+  atomic_long count;
+  atomic_size_t head;
+  atomic_size_t tail;
+} lring;
+
+/* Actor with a bounded lock-free mailbox. Any thread may send, only the
+   pool task currently running the actor receives. */
+struct lactor {
+  atomic_int ref;
+  lenv* env;
+  lval* handler;
+  lval* state;
+  pthread_mutex_t lock;
+
+  lring box;
+
+  atomic_long pending;
+  atomic_int scheduled;
+  lpool* pool;
+};
+
+/* Mutable reference shared between threads. The value is replaced with a
+   CAS and never modified in place. Replaced values are retired with the
+   epoch they left in and freed once the epoch is two further on, by which
+   point no reader that could have loaded them is left. */
+typedef struct lretired {
+  lval* val;
+  long epoch;
+  struct lretired* next;
+} lretired;
+
+struct latom {
+  atomic_int ref;
+  _Atomic(lval*) val;
+  atomic_long epoch;
+  atomic_int readers[2];
+  _Atomic(lretired*) retired;
+};
+
+/* Large dead values waiting to be freed by the background sweeper */
+#define LSWEEP_MIN 1024
+
+typedef struct lsweep_node {
+  lval* val;
+  struct lsweep_node* next;
+} lsweep_node;
+
+/* A context's sweeper, its thread started the first time it is needed */
+typedef struct {
+  _Atomic(lsweep_node*) head;
+  atomic_long pending;
+  atomic_int started;
+  int quit;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+} lsweep;
+
+/* Green thread with a stack of its own. All green threads of a context
+   run on the thread that created it and switch only when one of them
+   yields, sleeps or awaits. Stacks are reserved at the size of a main
+   thread's but only committed as they are touched, and evaluation
+   fails with an error once fewer than LSTACK_SLACK bytes are left. */
+#define LGREEN_STACK (8 * 1024 * 1024)
+#define LSTACK_SLACK (64 * 1024)
+
+typedef struct lgreen {
+  ucontext_t uc;
+  char* stack;
+  size_t size;
+  lfuture* fut;
+  long wake;
+  struct lgreen* next;
+} lgreen;
+
+/* Green threads parked on I/O are registered with an epoll instance,
+   and the scheduler blocks in it whenever nothing else can run. A
+   descriptor has a single registration, so its waiters are kept per
+   descriptor with one slot for a reader and one for a writer. */
+
+typedef struct {
+  lgreen* reader;
+  lgreen* writer;
+} lfdwait;
+
+typedef struct {
+  pthread_t owner;
+  lgreen main;
+  lgreen* current;
+  lgreen* head;
+  lgreen* tail;
+  lgreen* sleeping;
+  lgreen* dead;
+  lgreen* joiner;
+  int count;
+  int epfd;
+  int waiting;
+  lfdwait* fds;
+  int nfds;
+
+  /* Threads woken from other OS threads, announced through wakefd */
+  _Atomic(lgreen*) inbox;
+  int wakefd;
+} lsched;
+
+/* Green thread blocked on one or more channels. It is queued on each of
+   them, and whoever moves state from 0 to 1 wakes it, so it is only
+   woken once however many channels become ready. */
+typedef struct {
+  atomic_int state;
+  lsched* sched;
+  lgreen* green;
+} lwaiter;
+
+typedef struct lwnode {
+  lwaiter* w;
+  struct lwnode* next;
+} lwnode;
+
+/* Channel between concurrent tasks. Bounded channels use the lock-free
+   ring, unbounded ones a growable buffer under the lock. The lock also
+   guards the queues of parked receivers and senders, which are only
+   taken when the counts say someone is parked. */
+struct lchan {
+  atomic_int ref;
+  long cap;
+  lring ring;
+
+  lval** buf;
+  long size;
+  long first;
+  long count;
+
+  pthread_mutex_t lock;
+  lwnode* recvq;
+  lwnode* sendq;
+  atomic_int nrecv;
+  atomic_int nsend;
+  atomic_int closed;
+};
+
+/* Interpreter context, owning everything one interpreter instance uses */
+struct lctx {
+  lenv* env;
+
+  int hashcons;
+  ltable interned;
+
+  /* Worker threads, started the first time they are needed */
+  lpool* pool;
+  pthread_mutex_t lock;
+
+  lsched sched;
+  lsweep sweep;
+};
+
+lctx* lctx_new(void);
+void lctx_del(lctx* c);
+
 /* Create Enumeration of Possible Error Types */
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
 /* Function declarations */
-lval* eval(mpc_ast_t*);
-lval* eval_op(lval*, char*, lval*);
 lval* lval_eval_sexpr(lenv*, lval*);
 lval* lval_eval(lenv*, lval*);
 
@@ -75,8 +469,8 @@ lval* lval_err(char* fmt, ...);
 lval* lval_sym(char*);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
-lval* lval_read_num(mpc_ast_t*);
-lval* lval_read(mpc_ast_t*);
+lval* lval_read_src(lctx* c, const char* filename, const char* src, long len);
+char* lval_load_src(const char* path, long* len, int* mapped);
 lval* lval_add(lval*, lval*);
 lval* lval_copy(lval* v);
 void lval_expr_print(lval*, char, char);
@@ -89,13 +483,14 @@ void lval_println(lval*);
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
 lval* lenv_get(lenv* e, lval* k);
+lval** lenv_slot(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v); 
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
 void lenv_add_builtins(lenv* e);
 
 lval* builtin_def(lenv* e, lval* a);
-lval* builtin_put(lenv*, lval*, char*);
+lval* builtin_put(lenv*, lval*);
 lval* builtin_var(lenv*, lval*, char*);
 
 
@@ -125,17 +520,168 @@ lval* builtin_if(lenv*, lval*);
 
 lval* lval_str(char* s);
 void lval_print_str(lval*);
-lval* lval_read_str(mpc_ast_t* t);
-
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr; 
-mpc_parser_t* Lispy;
 
 lval* builtin_load(lenv*, lval*);
 lval* builtin_print(lenv*, lval*);
+lval* builtin_err(lenv*, lval*);
+
+/* Hashing */
+uint64_t lhash_str(char* s);
+uint64_t lhash_mix(uint64_t h, uint64_t x);
+uint64_t lval_hash(lval* v);
+
+/* Hash table map */
+lval* lval_dict(void);
+lval* lval_dict_get(lval* d, lval* k, uint64_t h);
+void lval_dict_set(lval* d, lval* k, lval* v);
+int lval_dict_remove(lval* d, lval* k);
+void lval_dict_grow(lval* d);
+void lval_dict_own(lval* d);
+void ldict_release(ldict* t);
+
+/* Persistent map */
+lval* lval_pdict(void);
+lhamt* lhamt_new(int count);
+lhamt* lhamt_clone(lhamt* n);
+void lhamt_release(lhamt* n);
+lval* lhamt_get(lhamt* n, uint64_t h, lval* k, int shift);
+lhamt* lhamt_assoc(lhamt* n, uint64_t h, lval* k, lval* v, int shift, int* added);
+lhamt* lhamt_dissoc(lhamt* n, uint64_t h, lval* k, int shift, int* removed);
+void lhamt_keys(lhamt* n, lval* out);
+uint64_t lhamt_hash(lhamt* n);
+int lhamt_eq(lhamt* x, lhamt* y);
+
+lval* lval_map_get(lval* m, lval* k);
+int lval_map_eq(lval* x, lval* y);
+void lval_map_print(lval* v);
+
+/* Hash-consing */
+lval* lval_intern(ltable* t, lval* v);
+void lval_unintern(lval* v);
+lval* lval_hashcons(lctx* c, lval* v);
+lval* lval_thaw(lval* v);
+lval* builtin_hashcons(lenv*, lval*);
+
+/* Memoization */
+lmemo* lmemo_new(lval* fun, int limit);
+void lmemo_release(lmemo* m);
+lval* lmemo_call(lenv* e, lmemo* m, lval* a);
+lval* builtin_memo(lenv*, lval*);
+lval* builtin_memo_stats(lenv*, lval*);
+
+/* Lazy sequences */
+lseq* lseq_new(int kind);
+void lseq_release(lseq* s);
+lseq* lseq_from(lval* v);
+lval* lval_seq(lseq* s);
+lcursor* lcursor_new(lseq* s);
+void lcursor_del(lcursor* c);
+lval* lcursor_next(lenv* e, lcursor* c);
+lval* lval_apply1(lenv* e, lval* f, lval* x);
+lval* builtin_range(lenv*, lval*);
+lval* builtin_iterate(lenv*, lval*);
+lval* builtin_map(lenv*, lval*);
+lval* builtin_filter(lenv*, lval*);
+lval* builtin_take(lenv*, lval*);
+lval* builtin_fold(lenv*, lval*);
+lval* builtin_collect(lenv*, lval*);
+
+/* Thread pool */
+lpool* lpool_new(int count);
+void lpool_del(lpool* p);
+lpool* lctx_pool(lctx* c);
+void lpool_submit(lpool* p, ltask* t);
+ltask* lpool_find(lpool* p);
+void lpool_wait(lpool* p, atomic_long* remaining);
+void lpool_finish(lpool* p, atomic_long* remaining, long n);
+lval* lval_parallel(lenv* e, lval* a, int reduce);
+lval* builtin_pmap(lenv*, lval*);
+lval* builtin_preduce(lenv*, lval*);
+
+/* Futures */
+lenv* lenv_snapshot(lenv* e, int globals);
+lval* lval_future(lfuture* f);
+void lfuture_release(lfuture* f);
+lval* builtin_future(lenv*, lval*);
+lval* builtin_await(lenv*, lval*);
+
+/* Actors */
+void lring_init(lring* r, long cap);
+void lring_free(lring* r);
+int lring_push(lring* r, lval* v, size_t* at);
+lval* lring_pop(lring* r);
+lval* lval_actor(lactor* a);
+void lactor_release(lactor* a);
+int lactor_send(lactor* a, lval* msg);
+void lactor_schedule(lactor* a);
+lval* builtin_actor(lenv*, lval*);
+lval* builtin_send(lenv*, lval*);
+lval* builtin_state(lenv*, lval*);
+
+/* Green threads */
+int lsched_yield(lctx* c);
+void lsched_sleep(lctx* c, long ms);
+void lsched_drain(lctx* c);
+int lsched_await(lctx* c, lfuture* f);
+int lsched_wait_fd(lctx* c, int fd, int write);
+void lsched_wake(lsched* s, lgreen* g);
+lval* builtin_spawn(lenv*, lval*);
+char* lstack_new(size_t* size);
+void lstack_del(char* stack, size_t size);
+int lstack_exhausted(void);
+lval* builtin_yield(lenv*, lval*);
+lval* builtin_sleep(lenv*, lval*);
+
+/* Generators */
+lval* lgen_call(lenv* e, lval* f, lval* a);
+lgen* lgen_new(lseq* s);
+void lgen_del(lgen* g);
+lval* lgen_next(lgen* g);
+lval* builtin_gen(lenv*, lval*);
+
+/* Asynchronous I/O */
+lval* builtin_open(lenv*, lval*);
+lval* builtin_read(lenv*, lval*);
+lval* builtin_write(lenv*, lval*);
+lval* builtin_close(lenv*, lval*);
+lval* builtin_listen(lenv*, lval*);
+lval* builtin_accept(lenv*, lval*);
+lval* builtin_connect(lenv*, lval*);
+lval* builtin_after(lenv*, lval*);
+
+/* Background sweeping */
+lctx* lsweep_swap(lctx* c);
+int lsweep_defer(lval* v);
+void lsweep_flush(lsweep* s);
+
+/* Atoms */
+lval* lval_atom(latom* a);
+void latom_release(latom* a);
+lval* latom_deref(latom* a);
+lval* builtin_atom(lenv*, lval*);
+lval* builtin_deref(lenv*, lval*);
+lval* builtin_swap(lenv*, lval*);
+lval* builtin_reset(lenv*, lval*);
+lval* builtin_cas(lenv*, lval*);
+
+/* Channels */
+lval* lval_chan(lchan* c);
+void lchan_release(lchan* c);
+lval* builtin_chan(lenv*, lval*);
+lval* builtin_chan_send(lenv*, lval*);
+lval* builtin_recv(lenv*, lval*);
+lval* builtin_select(lenv*, lval*);
+lval* builtin_chan_close(lenv*, lval*);
+
+/* Map builtins */
+lval* builtin_dict(lenv*, lval*);
+lval* builtin_pdict(lenv*, lval*);
+lval* builtin_get(lenv*, lval*);
+lval* builtin_assoc(lenv*, lval*);
+lval* builtin_dissoc(lenv*, lval*);
+lval* builtin_map_set(lenv*, lval*);
+lval* builtin_map_unset(lenv*, lval*);
+lval* builtin_map_var(lenv*, lval*, char*);
+lval* builtin_keys(lenv*, lval*);
+lval* builtin_size(lenv*, lval*);
 lval* builtin_err(lenv*, lval*);
\ No newline at end of file